@@ -10,8 +10,11 @@
  *
  */
 
+#include <cstddef>
+#include <cstring>
 #include <sstream>
 #include <unordered_map>
+#include <vector>
 
 #include "ppapi/cpp/graphics_2d.h"
 #include "ppapi/cpp/image_data.h"
@@ -229,6 +232,7 @@ private:
         ControlMessage("disconnected", "Socket closed");
         connected_ = false;
         screen_flying_ = false;
+        subscribed_ = false;
         Paint(true);
     }
 
@@ -267,7 +271,8 @@ private:
 
         if (server_version_ != VERSION) {
             /* TODO: Remove VF1 compatiblity */
-            if (server_version_ == "VF1" || server_version_ == "VF2") {
+            if (server_version_ == "VF1" || server_version_ == "VF2" ||
+                server_version_ == "VF3") {
                 WarningMessage() << "Outdated server version ("
                                  << server_version_ << "), expecting " << VERSION
                                  << ". Please update your chroot.";
@@ -282,7 +287,12 @@ private:
         connected_ = true;
         SocketSend(pp::Var("VOK"), false);
         ControlMessage("connected", "Version received");
+        SendCursorHashes();
         ChangeResolution(size_.width(), size_.height());
+        if (UseRing()) {
+            RegisterBuffers();
+            Subscribe();
+        }
         /* Start requesting frames */
         OnFlush();
         return true;
@@ -290,11 +300,55 @@ private:
 
     /* Receives and handles a screen_reply request */
     bool SocketParseScreen(const char* data, int datalen) {
-        if (!CheckSize(datalen, sizeof(struct screen_reply), "screen_reply"))
-            return false;
-
         struct screen_reply* reply = (struct screen_reply*)data;
-        if (reply->updated) {
+        /* TODO: Remove VF3 compatibility (no rectangle list) */
+        if (server_version_ != VERSION) {
+            if (!CheckSize(datalen, offsetof(struct screen_reply, nrects),
+                           "screen_reply"))
+                return false;
+        } else {
+            if (datalen < sizeof(struct screen_reply)) {
+                ErrorMessage() << "Invalid screen_reply packet (" << datalen
+                               << " < " << sizeof(struct screen_reply) << ").";
+                return false;
+            }
+            if (!CheckSize(datalen, sizeof(struct screen_reply) +
+                               reply->nrects*sizeof(struct rect),
+                           "screen_reply"))
+                return false;
+        }
+
+        if (reply->updated && server_version_ == VERSION) {
+            Message m = LogMessage(3);
+            m << "Damage:";
+            for (int i = 0; i < reply->nrects; i++) {
+                m << " " << reply->rects[i].width << "x"
+                  << reply->rects[i].height << "+" << reply->rects[i].x
+                  << "+" << reply->rects[i].y;
+            }
+        }
+
+        if (UseRing()) {
+            screen_flying_ = false;
+            int i = reply->buffer;
+            if (i >= kRingSize || ring_[i].state != kBufferFlying ||
+                    ring_[i].img.size() !=
+                        pp::Size(reply->width, reply->height)) {
+                /* The ring was registered again since the request */
+                LogMessage(1) << "Frame for stale buffer " << i;
+            } else if (reply->updated && !reply->shmfailed) {
+                ring_[i].state = kBufferReady;
+                if (painting_ < 0)
+                    PaintBuffer(i);
+            } else {
+                ring_[i].state = kBufferFree;
+                if (reply->shmfailed)
+                    force_refresh_ = true;
+            }
+            /* Let the server fill the next buffer while this one is
+             * flushed. */
+            ScheduleRequest();
+        } else if (reply->updated) {
             if (!reply->shmfailed) {
                 Paint(false);
             } else {
@@ -373,9 +427,58 @@ private:
         cursor_cache_[cursor->cursor_serial].hot = hot;
         pp::MouseCursor::SetCursor(this, PP_MOUSECURSOR_TYPE_CUSTOM,
                                        img, hot);
+
+        /* Keep the image across connections, identified by its content */
+        if (cursor_images_.size() >= MAX_CURSOR_HASHES)
+            cursor_images_.clear();
+        uint32_t hash = cursor_hash(cursor->width, cursor->height,
+                                    cursor->xhot, cursor->yhot,
+                                    cursor->pixels);
+        cursor_images_[hash] = cursor_cache_[cursor->cursor_serial];
         return true;
     }
 
+    /* Receives and handles a cursor_known reply: the server did not send
+     * the image, as we already have it. */
+    bool SocketParseCursorKnown(const char* data, int datalen) {
+        if (!CheckSize(datalen, sizeof(struct cursor_known), "cursor_known"))
+            return false;
+        struct cursor_known* known = (struct cursor_known*)data;
+
+        std::unordered_map<uint32_t, Cursor>::iterator it =
+            cursor_images_.find(known->hash);
+        if (it == cursor_images_.end()) {
+            ErrorMessage() << "Unknown cursor hash " << known->hash;
+            return true;
+        }
+
+        LogMessage(2) << "Cursor " << known->cursor_serial
+                      << " known (" << known->hash << ")";
+        cursor_cache_[known->cursor_serial] = it->second;
+        pp::MouseCursor::SetCursor(this, PP_MOUSECURSOR_TYPE_CUSTOM,
+                                   it->second.img, it->second.hot);
+        return true;
+    }
+
+    /* Tells the server which cursor images we already have. */
+    void SendCursorHashes() {
+        /* Only supported by VF4 servers */
+        if (server_version_ != VERSION)
+            return;
+
+        struct cursor_hashes* h;
+        int count = cursor_images_.size();
+        pp::VarArrayBuffer array_buffer(sizeof(*h) + count*sizeof(uint32_t));
+        h = static_cast<struct cursor_hashes*>(array_buffer.Map());
+        h->type = 'H';
+        h->count = count;
+        int i = 0;
+        for (auto it = cursor_images_.begin(); it != cursor_images_.end(); ++it)
+            h->hashes[i++] = it->first;
+        array_buffer.Unmap();
+        SocketSend(array_buffer, false);
+    }
+
     /* Receives and handles a resolution request */
     bool SocketParseResolution(const char* data, int datalen) {
         if (!CheckSize(datalen, sizeof(struct resolution), "resolution"))
@@ -439,6 +542,9 @@ private:
             case 'P':  /* New cursor data is received */
                 if (SocketParseCursor(data, datalen)) return;
                 break;
+            case 'H':  /* Cursor we already have */
+                if (SocketParseCursorKnown(data, datalen)) return;
+                break;
             case 'R':  /* Resolution request reply */
                 if (SocketParseResolution(data, datalen)) return;
                 break;
@@ -465,24 +571,16 @@ private:
     }
 
     /* Sends a WebSocket request, possibly flushing current mouse position
-     * first */
+     * first. Queued input events are always sent before the request. */
     void SocketSend(const pp::Var& var, bool flushmouse) {
         if (!connected_) {
             LogMessage(-1) << "SocketSend: not connected!";
             return;
         }
 
-        if (pending_mouse_move_ && flushmouse) {
-            struct mousemove* mm;
-            pp::VarArrayBuffer array_buffer(sizeof(*mm));
-            mm = static_cast<struct mousemove*>(array_buffer.Map());
-            mm->type = 'M';
-            mm->x = mouse_pos_.x();
-            mm->y = mouse_pos_.y();
-            array_buffer.Unmap();
-            websocket_->SendMessage(array_buffer);
-            pending_mouse_move_ = false;
-        }
+        if (flushmouse)
+            SendMouseMove();
+        FlushInput();
 
         websocket_->SendMessage(var);
     }
@@ -606,6 +704,8 @@ public:
                  * Also, Javascript button numbers are 0-based (left=0), while
                  * X11 numbers are 1-based (left=1). */
                 SendClick(mouse_event.GetButton() + 1, down ? 1 : 0);
+            } else {
+                SendMouseMove();
             }
         } else if (event.GetType() == PP_INPUTEVENT_TYPE_WHEEL) {
             pp::WheelInputEvent wheel_event(event);
@@ -710,6 +810,7 @@ public:
                     SendClick(1, down ? 1 : 0);
                 } else {
                     m << "MOVE";
+                    SendMouseMove();
                 }
 
                 m << " " << touch_event_pos.x() << "/" << touch_event_pos.y();
@@ -754,6 +855,9 @@ private:
 
         size_ = new_size;
         force_refresh_ = true;
+
+        if (connected_ && UseRing() && ring_[0].img.size() != size_)
+            RegisterBuffers();
     }
 
     /* Requests the server for a resolution change. */
@@ -849,13 +953,112 @@ private:
 
     /* Changes the target FPS: avoid unecessary refreshes to save CPU */
     void SetTargetFPS(int new_target_fps) {
+        int old_target_fps = target_fps_;
+        target_fps_ = new_target_fps;
+        if (subscribed_ && new_target_fps != old_target_fps)
+            Subscribe();
         /* When increasing the fps, immediately ask for a frame, and force
          * refresh the display (we probably just gained focus). */
-        if (new_target_fps > target_fps_) {
+        if (new_target_fps > old_target_fps) {
             force_refresh_ = true;
-            RequestScreen(request_token_);
+            if (subscribed_)
+                SubmitBuffers();
+            else
+                RequestScreen(request_token_);
         }
-        target_fps_ = new_target_fps;
+    }
+
+    /* Batched input is only supported by VF4 servers */
+    bool UseBatchedInput() {
+        return server_version_ == VERSION;
+    }
+
+    /* Queues an input event, to be sent in an 'E' packet once the current
+     * input events are handled. The mouse position is queued first if it
+     * changed. */
+    void QueueInput(char type, int down, uint8_t code) {
+        if (pending_mouse_move_ && type != 'M')
+            QueueMouseMove();
+
+        struct input_event ev = {};
+        ev.type = type;
+        ev.down = down;
+        ev.code = code;
+        ev.x = mouse_pos_.x();
+        ev.y = mouse_pos_.y();
+        ev.time = (uint64_t)(pp::Module::Get()->core()->GetTimeTicks() * 1000);
+        input_events_.push_back(ev);
+
+        if (input_events_.size() >= MAX_INPUT_EVENTS - 1) {
+            /* Leave room for a mouse move before the next event */
+            FlushInput();
+        } else if (!input_flush_scheduled_) {
+            input_flush_scheduled_ = true;
+            pp::Module::Get()->core()->CallOnMainThread(0,
+                callback_factory_.NewCallback(&KiwiInstance::FlushInput));
+        }
+    }
+
+    /* Queues the mouse position. Consecutive moves are merged: only the
+     * last position matters. */
+    void QueueMouseMove() {
+        pending_mouse_move_ = false;
+        if (!input_events_.empty() && input_events_.back().type == 'M') {
+            struct input_event& ev = input_events_.back();
+            ev.x = mouse_pos_.x();
+            ev.y = mouse_pos_.y();
+            ev.time = (uint64_t)(pp::Module::Get()->core()->GetTimeTicks() *
+                                 1000);
+            return;
+        }
+        QueueInput('M', 0, 0);
+    }
+
+    /* Sends the mouse position, if it changed. Motion does not wait for the
+     * next frame request: the server may hold that one for a while, or never
+     * answer it if the screen is idle and frames are subscribed. VF4 servers
+     * get it in the next 'E' packet, older ones in a 'M' packet. */
+    void SendMouseMove() {
+        if (!pending_mouse_move_ || !connected_)
+            return;
+
+        if (UseBatchedInput()) {
+            QueueMouseMove();
+            return;
+        }
+
+        struct mousemove* mm;
+        pp::VarArrayBuffer array_buffer(sizeof(*mm));
+        mm = static_cast<struct mousemove*>(array_buffer.Map());
+        mm->type = 'M';
+        mm->x = mouse_pos_.x();
+        mm->y = mouse_pos_.y();
+        array_buffer.Unmap();
+        websocket_->SendMessage(array_buffer);
+        pending_mouse_move_ = false;
+    }
+
+    /* Sends queued input events.
+     * Parameter is ignored: used for callbacks */
+    void FlushInput(int32_t /*result*/ = 0) {
+        input_flush_scheduled_ = false;
+        if (input_events_.empty())
+            return;
+
+        if (connected_) {
+            struct input* in;
+            int count = input_events_.size();
+            pp::VarArrayBuffer array_buffer(sizeof(*in) +
+                                            count*sizeof(struct input_event));
+            in = static_cast<struct input*>(array_buffer.Map());
+            in->type = 'E';
+            in->count = count;
+            memcpy(in->events, input_events_.data(),
+                   count*sizeof(struct input_event));
+            array_buffer.Unmap();
+            websocket_->SendMessage(array_buffer);
+        }
+        input_events_.clear();
     }
 
     /* Sends a mouse click.
@@ -872,6 +1075,12 @@ private:
             }
         }
 
+        if (UseBatchedInput()) {
+            QueueInput('C', down, button);
+            SetTargetFPS(kFullFPS);
+            return;
+        }
+
         pp::VarArrayBuffer array_buffer(sizeof(*mc));
         mc = static_cast<struct mouseclick*>(array_buffer.Map());
         mc->type = 'C';
@@ -911,6 +1120,13 @@ private:
     /* Sends a keycode */
     void SendKeyCode(uint8_t keycode, int down) {
         struct key* k;
+
+        if (UseBatchedInput()) {
+            QueueInput('K', down, keycode);
+            SetTargetFPS(kFullFPS);
+            return;
+        }
+
         pp::VarArrayBuffer array_buffer(sizeof(*k));
         k = static_cast<struct key*>(array_buffer.Map());
         k->type = 'K';
@@ -942,29 +1158,156 @@ private:
             LogMessage(2) << "Old token, or screen flying...";
             return;
         }
+
+        int index = -1;
+        if (UseRing()) {
+            for (int i = 0; i < kRingSize; i++) {
+                if (ring_[i].state == kBufferFree) {
+                    index = i;
+                    break;
+                }
+            }
+            if (index < 0) {
+                LogMessage(2) << "No free buffer...";
+                return;
+            }
+        }
+
         screen_flying_ = true;
         request_token_++;
+        SendScreen(index);
+    }
 
+    /* Sends a frame request, for buffer index of the ring, or for
+     * image_data_ if index is negative. */
+    void SendScreen(int index) {
         struct screen* s;
-        pp::VarArrayBuffer array_buffer(sizeof(*s));
+        /* TODO: Remove VF3 compatibility (no buffer field) */
+        pp::VarArrayBuffer array_buffer(
+            UseRing() ? sizeof(*s) : offsetof(struct screen, buffer));
         s = static_cast<struct screen*>(array_buffer.Map());
 
         s->type = 'S';
         s->shm = 1;
         s->refresh = force_refresh_;
         force_refresh_ = false;
-        s->width = image_data_.size().width();
-        s->height = image_data_.size().height();
-        s->paddr = (uint64_t)image_data_.data();
-        uint64_t sig = ((uint64_t)rand() << 32) ^ rand();
-        uint64_t* data = static_cast<uint64_t*>(image_data_.data());
-        *data = sig;
-        s->sig = sig;
+        if (index >= 0) {
+            Buffer& b = ring_[index];
+            b.state = kBufferFlying;
+            s->ring = 1;
+            s->buffer = index;
+            s->width = b.img.size().width();
+            s->height = b.img.size().height();
+            s->paddr = (uint64_t)b.img.data();
+            /* The signature was overwritten by the previous frame */
+            *static_cast<uint64_t*>(b.img.data()) = b.sig;
+            s->sig = b.sig;
+            lastrequest_ = pp::Module::Get()->core()->GetTime();
+        } else {
+            s->width = image_data_.size().width();
+            s->height = image_data_.size().height();
+            s->paddr = (uint64_t)image_data_.data();
+            uint64_t sig = ((uint64_t)rand() << 32) ^ rand();
+            uint64_t* data = static_cast<uint64_t*>(image_data_.data());
+            *data = sig;
+            s->sig = sig;
+        }
 
         array_buffer.Unmap();
         SocketSend(array_buffer, true);
     }
 
+    /* Pipelined mode is only supported by VF4 servers */
+    bool UseRing() {
+        return server_version_ == VERSION;
+    }
+
+    /* Asks the server to push frames at target_fps_ (ring mode). */
+    void Subscribe() {
+        struct subscribe* u;
+        pp::VarArrayBuffer array_buffer(sizeof(*u));
+        u = static_cast<struct subscribe*>(array_buffer.Map());
+        u->type = 'U';
+        u->fps = target_fps_;
+        array_buffer.Unmap();
+        SocketSend(array_buffer, false);
+        subscribed_ = true;
+    }
+
+    /* Subscribed: hands all free buffers over to the server, which fills
+     * them when the screen changes, at the rate we subscribed to. */
+    void SubmitBuffers() {
+        if (!connected_)
+            return;
+        for (int i = 0; i < kRingSize; i++) {
+            if (ring_[i].state == kBufferFree && !ring_[i].img.is_null())
+                SendScreen(i);
+        }
+    }
+
+    /* Allocates the ring of buffers, and registers them with the server, so
+     * that it can look them up before the first frame is requested. */
+    void RegisterBuffers() {
+        PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
+
+        LogMessage(1) << "Registering " << kRingSize << " buffers "
+                      << size_.width() << "x" << size_.height();
+
+        for (int i = 0; i < kRingSize; i++) {
+            Buffer& b = ring_[i];
+            b.img = pp::ImageData(this, format, size_, false);
+            b.state = kBufferFree;
+            if (b.img.is_null())
+                continue;
+            b.sig = ((uint64_t)rand() << 32) ^ rand();
+            *static_cast<uint64_t*>(b.img.data()) = b.sig;
+
+            struct buffer* r;
+            pp::VarArrayBuffer array_buffer(sizeof(*r));
+            r = static_cast<struct buffer*>(array_buffer.Map());
+            r->type = 'B';
+            r->index = i;
+            r->width = size_.width();
+            r->height = size_.height();
+            r->paddr = (uint64_t)b.img.data();
+            r->sig = b.sig;
+            array_buffer.Unmap();
+            SocketSend(array_buffer, false);
+        }
+
+        painting_ = -1;
+        displayed_ = -1;
+        force_refresh_ = true;
+
+        /* The server dropped the buffers it was holding */
+        if (subscribed_)
+            SubmitBuffers();
+    }
+
+    /* Pipelined mode: asks for the next frame, no more than target_fps_
+     * times per second. */
+    void ScheduleRequest() {
+        /* The server takes care of the frame rate */
+        if (subscribed_) {
+            SubmitBuffers();
+            return;
+        }
+
+        if (target_fps_ <= 0)
+            return;
+
+        double delay = lastrequest_ + 1.0/target_fps_ -
+                       pp::Module::Get()->core()->GetTime();
+        if (delay > 0) {
+            pp::Module::Get()->core()->CallOnMainThread(
+                delay*1000,
+                callback_factory_.NewCallback(&KiwiInstance::RequestScreen),
+                request_token_);
+        } else {
+            RequestScreen(request_token_);
+        }
+    }
+
     /* Called when the last frame was displayed (Vsync-ed): allocates next
      * buffer and requests next frame.
      * Parameter is ignored: used for callbacks */
@@ -990,6 +1333,29 @@ private:
 
         LogMessage(5) << "OnFlush";
 
+        if (UseRing()) {
+            /* The flushed buffer is now displayed: the previous one can be
+             * filled again. */
+            if (painting_ >= 0) {
+                if (displayed_ >= 0)
+                    ring_[displayed_].state = kBufferFree;
+                ring_[painting_].state = kBufferDisplayed;
+                displayed_ = painting_;
+                painting_ = -1;
+            }
+
+            for (int i = 0; i < kRingSize; i++) {
+                if (ring_[i].state == kBufferReady) {
+                    PaintBuffer(i);
+                    break;
+                }
+            }
+
+            if (!screen_flying_)
+                ScheduleRequest();
+            return;
+        }
+
         screen_flying_ = false;
 
         /* Allocate next image. If size_ is the same, the previous buffer will
@@ -1010,6 +1376,14 @@ private:
         }
     }
 
+    /* Paints a buffer of the ring (pipelined mode). */
+    void PaintBuffer(int i) {
+        ring_[i].state = kBufferPainting;
+        painting_ = i;
+        image_data_ = ring_[i].img;
+        Paint(false);
+    }
+
     /* Paints the frame. In our context, simply replace the front buffer
      * content with image_data_. */
     void Paint(bool blank) {
@@ -1051,6 +1425,10 @@ private:
 
     const int kMaxRetry = 3;  /* Maximum number of connection attempts */
 
+    /* Number of buffers in the ring (pipelined mode, <= MAX_BUFFERS):
+     * one is displayed, one is flushed, and the server fills the last one. */
+    static const int kRingSize = 3;
+
     /* Class members */
     pp::CompletionCallbackFactory<KiwiInstance> callback_factory_{this};
     pp::Graphics2D context_;
@@ -1064,6 +1442,26 @@ private:
     pp::ImageData image_data_;
     int k_ = 0;
 
+    /* Pipelined mode: ring of buffers registered with the server */
+    enum BufferState {
+        kBufferFree,       /* Can be filled by the server */
+        kBufferFlying,     /* Requested, being filled by the server */
+        kBufferReady,      /* Filled, waiting for the current flush */
+        kBufferPainting,   /* Being flushed */
+        kBufferDisplayed   /* Current content of the context */
+    };
+    class Buffer {
+public:
+        pp::ImageData img;
+        uint64_t sig = 0;
+        BufferState state = kBufferFree;
+    };
+    Buffer ring_[kRingSize];
+    int painting_ = -1;  /* Index of the buffer being flushed */
+    int displayed_ = -1;  /* Index of the buffer being displayed */
+    PP_Time lastrequest_ = 0;  /* Time of the last frame request */
+    bool subscribed_ = false;  /* The server pushes frames into the ring */
+
     std::unique_ptr<pp::WebSocket> websocket_;
     int retry_ = 0;
     bool connected_ = false;
@@ -1076,6 +1474,9 @@ private:
     bool force_refresh_ = false;
 
     bool pending_mouse_move_ = false;
+    /* Input events waiting to be sent in an 'E' packet */
+    std::vector<struct input_event> input_events_;
+    bool input_flush_scheduled_ = false;
     pp::Point mouse_pos_{-1, -1};
     /* Mouse wheel accumulators */
     int mouse_wheel_x = 0;
@@ -1105,7 +1506,9 @@ public:
         pp::ImageData img;
         pp::Point hot;
     };
-    std::unordered_map<uint32_t, Cursor> cursor_cache_;
+    std::unordered_map<uint32_t, Cursor> cursor_cache_;  /* By serial */
+    /* By cursor_hash, kept across connections */
+    std::unordered_map<uint32_t, Cursor> cursor_images_;
 
     /* Display to connect to */
     int display_ = -1;
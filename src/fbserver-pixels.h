@@ -0,0 +1,306 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Pixel helpers of fbserver.c, in a header so that test/bench/pixels.c can
+ * check them.
+ *
+ */
+
+#ifndef FB_SERVER_PIXELS_H_
+#define FB_SERVER_PIXELS_H_
+
+#include "fbserver-proto.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/* Layouts of captured pixels */
+enum { PIXELS_BGRX, PIXELS_RGB565, PIXELS_OTHER };
+
+/* Format of captured pixels. The bit depth and masks are only used with
+ * PIXELS_OTHER. */
+struct pixel_format {
+    int pixels;  /* PIXELS_* */
+    int bits_per_pixel;  /* 16 or 32 */
+    unsigned long red_mask, green_mask, blue_mask;
+};
+
+
+/* Encodes width x height pixels (rows stride bytes apart) with CODEC_QOI
+ * into dst, which must hold 4 bytes per pixel. With runs_only, only
+ * QOI_OP_RUN and QOI_OP_RGB are used: faster, but only runs are compressed.
+ * Returns the encoded size. */
+static int qoi_encode(uint8_t* dst, const char* src,
+                      int width, int height, int stride, int runs_only) {
+    uint32_t index[64] = { 0 };
+    uint32_t prev = 0;
+    uint8_t* out = dst;
+    int run = 0;
+    int x, y;
+
+    for (y = 0; y < height; y++, src += stride) {
+        const uint32_t* row = (const uint32_t*)src;
+        for (x = 0; x < width; x++) {
+            uint32_t px = row[x] & 0xffffff;
+            if (px == prev) {
+                if (++run == 62) {
+                    *out++ = 0xc0 | (run - 1);  /* QOI_OP_RUN */
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *out++ = 0xc0 | (run - 1);
+                run = 0;
+            }
+
+            int r = px >> 16, g = (px >> 8) & 0xff, b = px & 0xff;
+            int h = QOI_HASH(r, g, b);
+            if (runs_only) {
+                /* QOI_OP_RGB */
+                *out++ = 0xfe;
+                *out++ = r;
+                *out++ = g;
+                *out++ = b;
+            } else if (index[h] == px) {
+                *out++ = h;  /* QOI_OP_INDEX */
+            } else {
+                index[h] = px;
+                int8_t dr = r - (int)(prev >> 16);
+                int8_t dg = g - (int)((prev >> 8) & 0xff);
+                int8_t db = b - (int)(prev & 0xff);
+                int8_t dr_dg = dr - dg, db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 &&
+                        db >= -2 && db <= 1) {
+                    /* QOI_OP_DIFF */
+                    *out++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 &&
+                           dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    /* QOI_OP_LUMA */
+                    *out++ = 0x80 | (dg + 32);
+                    *out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                } else {
+                    /* QOI_OP_RGB */
+                    *out++ = 0xfe;
+                    *out++ = r;
+                    *out++ = g;
+                    *out++ = b;
+                }
+            }
+            prev = px;
+        }
+    }
+    if (run > 0)
+        *out++ = 0xc0 | (run - 1);
+
+    return out - dst;
+}
+
+/* Returns the value of the channel in mask, scaled to 8 bits */
+static uint32_t expand_channel(uint32_t px, unsigned long mask) {
+    int shift = __builtin_ctzl(mask);
+    uint32_t max = mask >> shift;
+    return (((px & mask) >> shift)*255 + max/2) / max;
+}
+
+/* Loads n pixels in format f, starting at src, as 0x00RRGGBB. Returns src
+ * itself if f is that format already, dst otherwise. */
+static const uint32_t* load_pixels(uint32_t* dst, const char* src, int n,
+                                   const struct pixel_format* f) {
+    int i = 0;
+
+    if (f->pixels == PIXELS_BGRX)
+        return (const uint32_t*)src;
+
+    if (f->pixels == PIXELS_RGB565) {
+#ifdef __SSE2__
+        const __m128i mask5 = _mm_set1_epi16(0x1f);
+        const __m128i mask6 = _mm_set1_epi16(0x3f);
+        for (; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + 2*i));
+            __m128i r = _mm_srli_epi16(v, 11);
+            __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+            __m128i b = _mm_and_si128(v, mask5);
+            /* Replicate the high bits in the low bits */
+            r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+            g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+            b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+            __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(gb, r));
+            _mm_storeu_si128((__m128i*)(dst + i + 4),
+                             _mm_unpackhi_epi16(gb, r));
+        }
+#endif
+        for (; i < n; i++) {
+            uint16_t v;
+            memcpy(&v, src + 2*i, sizeof(v));
+            uint32_t r = v >> 11, g = (v >> 5) & 0x3f, b = v & 0x1f;
+            dst[i] = (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 |
+                     (b << 3 | b >> 2);
+        }
+        return dst;
+    }
+
+    for (; i < n; i++) {
+        uint32_t px;
+        if (f->bits_per_pixel == 32) {
+            memcpy(&px, src + 4*i, sizeof(px));
+        } else {
+            uint16_t v;
+            memcpy(&v, src + 2*i, sizeof(v));
+            px = v;
+        }
+        dst[i] = expand_channel(px, f->red_mask) << 16 |
+                 expand_channel(px, f->green_mask) << 8 |
+                 expand_channel(px, f->blue_mask);
+    }
+    return dst;
+}
+
+/* 2:1 box filter: averages the 2x2 blocks of rows a and b (2*n pixels) into
+ * n pixels. */
+static void downscale_pixels(uint32_t* dst, const uint32_t* a,
+                             const uint32_t* b, int n) {
+    int i = 0, c;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    for (; i + 2 <= n; i += 2) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + 2*i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + 2*i));
+        /* Vertical sums, 16-bit channels: pixels 0, 1 in lo, 2, 3 in hi */
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(va, zero),
+                                   _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(va, zero),
+                                   _mm_unpackhi_epi8(vb, zero));
+        /* Horizontal sums: 0+1, 2+3 */
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                                    _mm_unpackhi_epi64(lo, hi));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(sum, sum));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t px = 0;
+        for (c = 0; c < 32; c += 8) {
+            uint32_t sum = (a[2*i] >> c & 0xff) + (a[2*i+1] >> c & 0xff) +
+                           (b[2*i] >> c & 0xff) + (b[2*i+1] >> c & 0xff);
+            px |= ((sum + 2) >> 2) << c;
+        }
+        dst[i] = px;
+    }
+}
+
+/* Stores n 0x00RRGGBB pixels at dst, in format (FORMAT_*) */
+static void store_pixels(char* dst, const uint32_t* src, int n, int format) {
+    int i = 0;
+
+    if (format == FORMAT_BGRX) {
+        memcpy(dst, src, n*sizeof(*src));
+        return;
+    }
+
+    /* FORMAT_RGBA: swap red and blue, opaque alpha */
+#ifdef __SSE2__
+    const __m128i green = _mm_set1_epi32(0xff00);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i ff = _mm_set1_epi32(0xff);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), ff);
+        __m128i b = _mm_slli_epi32(_mm_and_si128(v, ff), 16);
+        __m128i ga = _mm_or_si128(_mm_and_si128(v, green), alpha);
+        _mm_storeu_si128((__m128i*)(dst + 4*i),
+                         _mm_or_si128(ga, _mm_or_si128(r, b)));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t px = src[i];
+        px = 0xff000000 | (px & 0xff00) | (px >> 16 & 0xff) |
+             (px & 0xff) << 16;
+        memcpy(dst + 4*i, &px, sizeof(px));
+    }
+}
+
+/* Copies n long pixels from XFixesCursorImage to 32-bit pixels */
+static void narrow_pixels(uint32_t* dst, const unsigned long* src, int n) {
+    int i = 0;
+    if (sizeof(*src) == sizeof(*dst)) {
+        memcpy(dst, src, n*sizeof(*dst));
+        return;
+    }
+#ifdef __SSE2__
+    /* Keep the low half of each 64-bit value */
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_castsi128_ps(_mm_loadu_si128((__m128i*)(src + i)));
+        __m128 b = _mm_castsi128_ps(_mm_loadu_si128((__m128i*)(src + i + 2)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_castps_si128(
+                             _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = src[i];
+}
+
+/* Tiles hashed with tile_hash, in tile hashing mode, are TILE_SIZE pixels
+ * wide and high (smaller on the right and bottom edges) */
+#define TILE_SIZE 64
+
+/* Hashes height rows of n bytes, stride bytes apart. This
+ * follows the XXH3 accumulation loop: each 64-bit lane accumulates the product
+ * of the 32-bit halves of the data xored with a key, plus the data of the
+ * other lane. The key changes with every block, so that moving content within
+ * the tile changes the hash. */
+static uint64_t tile_hash(const char* data, int n, int height, int stride) {
+    const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+    const uint64_t prime3 = 0x165667b19e3779f9ULL;
+    uint64_t acc[2] = { prime1, prime2 };
+    uint64_t key[2] = { 0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL };
+    uint64_t tail = 0;
+    int x, y;
+#ifdef __SSE2__
+    __m128i vacc = _mm_set_epi64x(acc[1], acc[0]);
+    __m128i vkey = _mm_set_epi64x(key[1], key[0]);
+    const __m128i step = _mm_set1_epi64x(prime3);
+#endif
+
+    for (y = 0; y < height; y++, data += stride) {
+        x = 0;
+#ifdef __SSE2__
+        for (; x + 16 <= n; x += 16) {
+            __m128i d = _mm_loadu_si128((const __m128i*)(data + x));
+            __m128i dk = _mm_xor_si128(d, vkey);
+            __m128i hi = _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1));
+            vacc = _mm_add_epi64(vacc, _mm_mul_epu32(dk, hi));
+            vacc = _mm_add_epi64(vacc,
+                        _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            vkey = _mm_add_epi64(vkey, step);
+        }
+#endif
+        for (; x + 16 <= n; x += 16) {
+            uint64_t d[2];
+            memcpy(d, data + x, sizeof(d));
+            uint64_t dk0 = d[0] ^ key[0], dk1 = d[1] ^ key[1];
+            acc[0] += (dk0 & 0xffffffff) * (dk0 >> 32) + d[1];
+            acc[1] += (dk1 & 0xffffffff) * (dk1 >> 32) + d[0];
+            key[0] += prime3;
+            key[1] += prime3;
+        }
+        for (; x < n; x++)
+            tail = (tail ^ (uint8_t)data[x]) * prime1;
+    }
+#ifdef __SSE2__
+    _mm_storeu_si128((__m128i*)acc, vacc);
+#endif
+
+    /* XXH3 avalanche */
+    uint64_t h = acc[0] ^ (acc[1] * prime2) ^ tail;
+    h ^= h >> 37;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif /* FB_SERVER_PIXELS_H_ */
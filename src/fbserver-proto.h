@@ -10,23 +10,76 @@
 #define FB_SERVER_PROTO_H_
 
 #include <stdint.h>
+#include <string.h>
 
 /* WebSocket constants */
-#define VERSION "VF3"
+#define VERSION "VF4"
 #define PORT_BASE 30010
 
+/* Maximum number of client buffers in the ring (pipelined mode) */
+#define MAX_BUFFERS 4
+
 /* Request for a frame */
 struct  __attribute__((__packed__)) screen {
     char type;  /* 'S' */
-    uint8_t shm:1;  /* Transfer data through shm */
+    uint8_t shm:1;  /* Transfer data through shm (else: rect_data packets) */
     uint8_t refresh:1;  /* Force a refresh, even if no damage is observed */
+    uint8_t ring:1;  /* shm: fill registered buffer instead of paddr */
     uint16_t width;
     uint16_t height;
     uint64_t paddr;  /* shm: client buffer address */
     uint64_t sig;  /* shm: signature at the beginning of buffer */
+    uint8_t buffer;  /* ring: index of the buffer to fill */
+};
+
+/* Register a client buffer in the ring, so that frames can be requested
+ * for that buffer while the client displays another one. Sent as soon as
+ * the buffer is allocated: the server looks it up and maps it in the
+ * background, before the first frame is requested. */
+struct  __attribute__((__packed__)) buffer {
+    char type;  /* 'B' */
+    uint8_t index;  /* Position in the ring (< MAX_BUFFERS) */
+    uint16_t width;
+    uint16_t height;
+    uint64_t paddr;  /* client buffer address */
+    uint64_t sig;  /* signature at the beginning of buffer */
 };
 
-/* Reply to request for a frame */
+/* Subscribe to frames (ring mode): from then on, 'S' requests hand over free
+ * buffers. The server fills them as soon as something changes on screen,
+ * at most fps times per second, and never answers when nothing changes.
+ * Can be sent again to change the frame rate. */
+struct  __attribute__((__packed__)) subscribe {
+    char type;  /* 'U' */
+    uint8_t fps;  /* Maximum frame rate, 0 to pause */
+};
+
+/* Pixel formats of client buffers */
+#define FORMAT_BGRX 0  /* 0x??RRGGBB, as captured from 24-bit visuals */
+#define FORMAT_RGBA 1  /* R, G, B, 0xff in memory (e.g. canvas ImageData) */
+
+/* Output format of frames, for the rest of the connection. Frame requests
+ * then give the size of the client buffer, which is the screen size divided
+ * by scale, and so are the rectangles in replies. The next frame is a full
+ * update. */
+struct  __attribute__((__packed__)) output {
+    char type;  /* 'O' */
+    uint8_t format;  /* FORMAT_* */
+    uint8_t scale;  /* 1, or 2 (2:1 box filter) */
+};
+
+/* Rectangle, in screen coordinates */
+struct  __attribute__((__packed__)) rect {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+};
+
+/* Maximum number of rectangles in a screen_reply */
+#define MAX_RECTS 16
+
+/* Reply to request for a frame (variable length) */
 struct  __attribute__((__packed__)) screen_reply {
     char type;  /* 'S' */
     uint8_t shm:1;  /* Data was transfered through shm */
@@ -36,6 +89,30 @@ struct  __attribute__((__packed__)) screen_reply {
     uint16_t width;
     uint16_t height;
     uint32_t cursor_serial;  /* Cursor to display */
+    uint8_t buffer;  /* ring: index of the buffer that was filled */
+    uint8_t nrects;  /* Number of rectangles that follow (0 if !updated) */
+    struct rect rects[0];  /* Areas that changed since the previous frame */
+};
+
+/* Codecs for rect_data */
+#define CODEC_RAW 0  /* 32-bit pixels, row after row */
+#define CODEC_QOI 1  /* QOI chunks (see below) */
+
+/* Position of a pixel in the CODEC_QOI index */
+#define QOI_HASH(r, g, b) (((r)*3 + (g)*5 + (b)*7 + 255*11) % 64)
+
+/* Pixel data of a changed area, for frames requested without shm (variable
+ * length). Sent before the screen_reply listing the rectangles: rectangles
+ * are split in bands of rows, one packet each.
+ * CODEC_QOI uses the chunks of the QOI image format, without header, end
+ * marker or alpha (QOI_OP_RGBA is never used), on pixels taken as 0x00RRGGBB.
+ * The previous pixel starts at 0, the index at all zeros (see QOI_HASH), and
+ * runs continue on the next row. */
+struct  __attribute__((__packed__)) rect_data {
+    char type;  /* 'D' */
+    uint8_t codec;  /* CODEC_* */
+    struct rect rect;  /* Area covered by data */
+    uint8_t data[0];
 };
 
 /* Request for cursor image (if cursor_serial is unknown) */
@@ -52,6 +129,76 @@ struct  __attribute__((__packed__)) cursor_reply {
     uint32_t pixels[0];  /* Payload, 32-bit per pixel */
 };
 
+/* Cursors already known to the client, identified by cursor_hash. Sent
+ * after connecting: the server then answers 'P' requests for these cursors
+ * with a cursor_known reply instead of the image. */
+struct  __attribute__((__packed__)) cursor_hashes {
+    char type;  /* 'H' */
+    uint8_t count;  /* Number of hashes that follow (<= MAX_CURSOR_HASHES) */
+    uint32_t hashes[0];
+};
+
+/* Maximum number of hashes in a cursor_hashes packet */
+#define MAX_CURSOR_HASHES 64
+
+/* Reply to a request for a cursor image that the client already has */
+struct  __attribute__((__packed__)) cursor_known {
+    char type;  /* 'H' */
+    uint32_t cursor_serial;  /* X11 unique serial number */
+    uint32_t hash;  /* cursor_hash of the image */
+};
+
+/* Processing stages timed by the server */
+enum {
+    STATS_EVENTS,  /* Draining the X event queue */
+    STATS_FIND_SHM,  /* Finding the client buffer */
+    STATS_CAPTURE,  /* Capturing the screen (XShmGetImage) */
+    STATS_CONVERT,  /* Converting to the output format (see 'O') */
+    STATS_COPY,  /* Copying captured data to the client buffer */
+    STATS_REPLY,  /* Writing the screen_reply */
+    STATS_FRAME,  /* Whole frame, from request to reply */
+    STATS_STAGES
+};
+
+/* Histogram bucket i counts durations of 2^i to 2^(i+1)-1 us. Bucket 0 also
+ * counts shorter durations, and the last bucket longer ones. */
+#define STATS_BUCKETS 24
+
+/* Request for timing statistics */
+struct  __attribute__((__packed__)) stats {
+    char type;  /* 'T' */
+    uint8_t reset:1;  /* Clear statistics once they are sent */
+};
+
+/* Timing statistics and input counters, accumulated since the server started
+ * (or was reset) */
+struct  __attribute__((__packed__)) stats_reply {
+    char type;  /* 'T' */
+    uint8_t stages;  /* STATS_STAGES */
+    uint8_t buckets;  /* STATS_BUCKETS */
+    uint64_t total_us[STATS_STAGES];  /* Sum of all durations */
+    uint32_t counts[STATS_STAGES][STATS_BUCKETS];  /* Histograms */
+    uint32_t input_injected;  /* Input events sent to X */
+    uint32_t input_coalesced;  /* Motion events dropped for a later one */
+};
+
+/* Content hash of a cursor image (FNV-1a, on 32-bit words). pixels does not
+ * need to be aligned (e.g. cursor_reply payload). */
+static inline uint32_t cursor_hash(uint16_t width, uint16_t height,
+                                   uint16_t xhot, uint16_t yhot,
+                                   const void* pixels) {
+    uint32_t hash = 2166136261u;
+    uint32_t pixel;
+    int i;
+    hash = (hash ^ (width | (uint32_t)height << 16)) * 16777619u;
+    hash = (hash ^ (xhot | (uint32_t)yhot << 16)) * 16777619u;
+    for (i = 0; i < width*height; i++) {
+        memcpy(&pixel, (const char*)pixels + 4*i, 4);
+        hash = (hash ^ pixel) * 16777619u;
+    }
+    return hash;
+}
+
 /* Change resolution (query + reply) */
 struct  __attribute__((__packed__)) resolution {
     char type;  /* 'R' */
@@ -94,4 +241,25 @@ struct  __attribute__((__packed__)) mouseclick {
     uint8_t button;  /* X11 button number (e.g. 1 is left) */
 };
 
+/* One input event in an 'E' packet */
+struct  __attribute__((__packed__)) input_event {
+    char type;  /* 'K' (key), 'C' (click) or 'M' (mouse move) */
+    uint8_t down:1;  /* K, C: 1: down, 0: up */
+    uint8_t code;  /* K: X11 KeyCode (8-255), C: X11 button number */
+    uint16_t x;  /* M: mouse position */
+    uint16_t y;
+    uint32_t time;  /* Client timestamp, in ms (wraps around) */
+};
+
+/* Maximum number of events in an 'E' packet */
+#define MAX_INPUT_EVENTS 64
+
+/* Batch of input events (variable length), replayed in order by the server,
+ * which then flushes them to X in one go. */
+struct  __attribute__((__packed__)) input {
+    char type;  /* 'E' */
+    uint8_t count;  /* Number of events that follow (<= MAX_INPUT_EVENTS) */
+    struct input_event events[0];
+};
+
 #endif  /* FB_SERVER_PROTO_H_ */
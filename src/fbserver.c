@@ -10,6 +10,8 @@
 
 #include "websocket.h"
 #include "fbserver-proto.h"
+#include "fbserver-pixels.h"
+#include "findnacld-proto.h"
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -19,30 +21,245 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <sys/shm.h>
+#include <sys/vfs.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/shm.h>
+#include <linux/magic.h>
 #include <sys/un.h>
-
-const char *SOCKET_PATH = "/var/run/crouton-ext/socket";
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+
+/* MIT-SHM 1.2 (fd passing) lets the X server write into client buffers */
+#if XCB_SHM_MAJOR_VERSION > 1 || XCB_SHM_MINOR_VERSION >= 2
+#define HAVE_SHM_FD 1
+#endif
 
 /* X11-related variables */
 static Display *dpy;
 static int damageEvent;
 static int fixesEvent;
+static int shmfd;  /* X server supports MIT-SHM fd passing */
+
+/* Main loop: WebSocket client, X connection, findnacl daemon and timer */
+#define MAX_EVENTS 8
+static int epfd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;  /* SIGUSR1: dump timing statistics */
+/* Maximum time a frame request is held when nothing changes on screen */
+#define HOLD_TIMEOUT_MS 500
+/* ... once input came in: the client may be waiting for the reply to send
+ * more, and input usually shows up as damage within a frame anyway. */
+#define INPUT_HOLD_MS 16
+
+/* Damaged region: short list of rectangles, that may overlap. */
+struct region {
+    int nrects;
+    struct rect rects[MAX_RECTS];
+};
 
 /* shm entry cache */
 struct cache_entry {
     uint64_t paddr; /* Address from PNaCl side */
+    int pid; /* nacl_helper process that owns the shm */
     int fd;
     void *map; /* mmap-ed memory */
     size_t length; /* mmap length */
+    int sync; /* mapping needs msync (not plain shared memory) */
+    XShmSegmentInfo shminfo; /* shmseg != 0 if attached to the X server */
+    int stale; /* Content is unknown: next write must copy the full frame */
+    struct region dirty; /* Areas that changed since the last write */
+    uint32_t lookup; /* findnacl request in flight for this entry, or 0 */
+    uint64_t used; /* cache_clock value when last used */
 };
 
-static struct cache_entry cache[2];
-static int next_entry;
+/* LRU cache of client buffers (non-ring mode), identified by paddr, and
+ * validated by the signature at the beginning of the buffer. */
+#define CACHE_SIZE 8
+static struct cache_entry cache[CACHE_SIZE];
+static uint64_t cache_clock;
+static struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} cache_stats;
+
+/* Client buffers registered in the ring (pipelined mode) */
+static struct cache_entry ring[MAX_BUFFERS];
+
+/* Changes observed since the last frame was sent. Damage is in root window
+ * coordinates, and clipped to the screen size when a frame is requested. */
+static struct region pending_damage;
+static int cursor_updated;
+static uint64_t cursor_serial;
+
+/* Cursor images, narrowed to 32-bit pixels, identified by X11 serial */
+struct cursor_entry {
+    uint32_t serial;  /* 0 if the entry is free */
+    uint32_t hash;  /* cursor_hash of the image */
+    uint16_t width, height;
+    uint16_t xhot, yhot;
+    uint32_t* pixels;
+    uint64_t used;  /* cursor_clock value when last used */
+};
 
-/* Remember which keys/buttons are currently pressed */
+#define CURSOR_CACHE_SIZE 16
+static struct cursor_entry cursor_cache[CURSOR_CACHE_SIZE];
+static uint64_t cursor_clock;
+
+/* Hashes of the cursors the client has, if it told us (see 'H' packets) */
+static uint32_t client_cursors[MAX_CURSOR_HASHES];
+static int nclient_cursors;
+static int client_cursor_hashes;  /* Client understands cursor_known replies */
+
+/* Frame requests held until something changes on screen. Without a
+ * subscription, only one request is held, and it is answered after
+ * HOLD_TIMEOUT_MS (INPUT_HOLD_MS if input came in) even if nothing
+ * changed. */
+static struct screen held_screens[MAX_BUFFERS];
+static int nheld;
+static uint64_t held_until;  /* When the held request is answered (ns) */
+
+/* Subscription (ring mode): the client hands over all its free buffers, and
+ * frames are pushed at most subscribed_fps times per second, only when
+ * something changed. */
+static int subscribed;
+static int subscribed_fps;
+static uint64_t last_push;  /* ns, CLOCK_MONOTONIC */
+
+/* Tile hashing (-H): some clients (e.g. GL through the dummy driver) do not
+ * report damage reliably. The screen is then captured whole, and tiles whose
+ * hash changed are reported as damage. While requests are held, the screen is
+ * polled every HASH_POLL_MS (or less often, if the frame rate is lower). */
+#define HASH_POLL_MS 33
+static int tile_hashing;
+static uint64_t* tile_hashes;  /* Row-major, tile_cols x tile_rows */
+static uint8_t* tile_changed;  /* Hash changed in the last hash_tiles */
+static int tile_cols, tile_rows;
+static int tiles_fresh;  /* img was just captured and hashed (poll_tiles) */
+
+/* Output format requested by the client ('O'): client coordinates are
+ * screen coordinates divided by out_scale. */
+static int out_format = FORMAT_BGRX;
+static int out_scale = 1;
+
+/* Worker pool (-j): large copies, conversions and tile hashes are split in
+ * bands of rows, one per thread. The copy into a client buffer runs in the
+ * background: input packets are handled in the meantime, and the reply is sent
+ * when the copy completes (see finish_frame). */
+#define MAX_WORKERS 8
+#define PARALLEL_MIN_BYTES (256*1024)  /* Smaller jobs are not split */
+static int nworkers = -1;  /* -1: number of CPUs, minus one */
+static pthread_t workers[MAX_WORKERS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_fd = -1;  /* eventfd: a background job completed */
+
+/* Job for the pool: the rows of the rectangles in region are split in nbands
+ * bands, and rows() is called for each part of a rectangle in a band. */
+struct job {
+    void (*rows)(const struct job* job, int band,
+                 const struct rect* r, int y0, int y1);
+    struct region region;
+    int pixel_bytes;  /* Bytes processed per pixel of region */
+    char* dst;
+    const char* src;
+    int stride;
+    int stream;  /* Copy with non-temporal stores */
+    int nbands;
+    int background;  /* Completion is signalled on pool_fd */
+    int pending;  /* Worker bands not done yet */
+    uint64_t generation;
+};
+static struct job pool_job;
+
+/* Frame copied in the background: the reply is sent by finish_frame */
+static struct {
+    int active;
+    struct screen_reply reply;
+    struct region update;
+    struct cache_entry* entry;
+    size_t size;
+    uint64_t start;  /* Frame request */
+    uint64_t copy_start;
+} inflight;
+
+/* Streaming (frames requested without shm): changed areas are sent in bands
+ * of at most STREAM_BAND_PIXELS, at one of the levels below. Each frame uses
+ * the level expected to get the data across soonest, given the measured
+ * socket throughput, and the encoding speed and compression ratio of each
+ * level. A level that was not used for STREAM_PROBE_FRAMES is tried again, to
+ * keep its estimates fresh. */
+enum {
+    STREAM_RAW,  /* No encoding */
+    STREAM_RUNS,  /* QOI, runs only */
+    STREAM_QOI,  /* QOI, all chunks */
+    STREAM_LEVELS
+};
+#define STREAM_BAND_PIXELS 65536
+#define STREAM_PROBE_FRAMES 32
+#define STREAM_MIN_MEASURE 16384  /* Bytes sent to measure the throughput */
+static struct {
+    double socket_bpns;  /* Bytes per ns written to the socket */
+    struct {
+        double encode_bpns;  /* Raw bytes per ns encoded */
+        double ratio;  /* Sent size / raw size */
+        int idle;  /* Frames sent since the level was last used */
+    } levels[STREAM_LEVELS];
+} stream;
+static uint8_t stream_buffer[STREAM_BAND_PIXELS*4];
+
+/* Persistent connection to the findnacl daemon */
+#define MAX_LOOKUPS 8
+static const char* findnacl_path = FINDNACL_SOCKET_PATH;  /* -s */
+static int findnacl_fd = -1;
+static uint32_t findnacl_id;
+/* Lookups in flight, or completed but not yet claimed */
+static struct lookup {
+    uint32_t id; /* 0 if the slot is free */
+    int done;
+    int pid;
+    int fd; /* result, -1 on error */
+} lookups[MAX_LOOKUPS];
+
+/* Input events are injected by a dedicated thread, through its own X
+ * connection, so that typing is not held back by a frame being captured or
+ * copied, or by a shm lookup. The main thread reads packets from the client
+ * and pushes events to a single-producer, single-consumer ring, then wakes
+ * the input thread up through input_fd (eventfd). */
+#define INPUT_QUEUE_SIZE 1024  /* Power of 2 */
+static Display* input_dpy;
+static pthread_t input_thread;
+static int input_fd = -1;
+/* eventfd: the input thread freed a slot, after the main thread found the
+ * queue full (input_waiting) */
+static int input_room_fd = -1;
+static int input_waiting;
+/* Events are struct input_event, plus 'Q': release all keys/buttons. Mouse
+ * positions are in X screen coordinates. */
+static struct input_event input_queue[INPUT_QUEUE_SIZE];
+static unsigned int input_head;  /* Next slot written by the main thread */
+static unsigned int input_tail;  /* Next slot read by the input thread */
+static int input_queued;  /* Events were queued since the last wake up */
+/* Last motion event, held back by the main thread while the queue is full */
+static struct input_event pending_motion;
+static int motion_pending;
+/* Counters, updated atomically. They are never reset: the main thread keeps
+ * the values of the last 'T' reset in input_stats_base. */
+static struct {
+    uint32_t injected;  /* Events sent to X */
+    uint32_t coalesced;  /* Motion events superseded by the next one */
+} input_stats, input_stats_base;
+
+/* Remember which keys/buttons are currently pressed (input thread only) */
 typedef enum { MOUSE=1, KEYBOARD=2 } keybuttontype;
 struct keybutton {
     keybuttontype type;
@@ -91,15 +308,306 @@ void kb_release_all() {
     for (i = 0; i < pressed_len; i++) {
         if (pressed[i].type == MOUSE) {
             log(2, "Mouse %d", pressed[i].code);
-            XTestFakeButtonEvent(dpy, pressed[i].code, 0, CurrentTime);
+            XTestFakeButtonEvent(input_dpy, pressed[i].code, 0, CurrentTime);
         } else if (pressed[i].type == KEYBOARD) {
             log(2, "Keyboard %d", pressed[i].code);
-            XTestFakeKeyEvent(dpy, pressed[i].code, 0, CurrentTime);
+            XTestFakeKeyEvent(input_dpy, pressed[i].code, 0, CurrentTime);
         }
     }
     pressed_len = 0;
 }
 
+/* Presses (down=1) or releases a key, and keeps track of it */
+static void fake_key(uint8_t keycode, int down) {
+    log(2, "Key: kc=%04x", keycode);
+    XTestFakeKeyEvent(input_dpy, keycode, down, CurrentTime);
+    if (down) {
+        kb_add(KEYBOARD, keycode);
+    } else {
+        kb_remove(KEYBOARD, keycode);
+    }
+}
+
+/* Presses (down=1) or releases a mouse button, and keeps track of it */
+static void fake_button(uint8_t button, int down) {
+    XTestFakeButtonEvent(input_dpy, button, down, CurrentTime);
+    if (down) {
+        kb_add(MOUSE, button);
+    } else {
+        kb_remove(MOUSE, button);
+    }
+}
+
+/* Injects one queued event (input thread) */
+static void inject_input(const struct input_event* ev) {
+    switch (ev->type) {
+    case 'K':
+        fake_key(ev->code, ev->down);
+        break;
+    case 'C':
+        fake_button(ev->code, ev->down);
+        break;
+    case 'M':
+        XTestFakeMotionEvent(input_dpy, 0, ev->x, ev->y, CurrentTime);
+        break;
+    case 'Q':
+        kb_release_all();
+        break;
+    }
+}
+
+/* Input thread: injects queued events, flushing them to X once the queue is
+ * empty, then sleeps until more are queued. Of consecutive motion events,
+ * only the last one is injected: X would not render the others anyway. */
+static void* input_main(void* arg) {
+    uint64_t count;
+    while (1) {
+        if (read(input_fd, &count, sizeof(count)) < 0) {
+            trueorabort(errno == EINTR, "read input_fd");
+            continue;
+        }
+        unsigned int tail = input_tail, head;
+        while (tail != (head = __atomic_load_n(&input_head,
+                                               __ATOMIC_ACQUIRE))) {
+            const struct input_event* ev =
+                &input_queue[tail % INPUT_QUEUE_SIZE];
+            if (ev->type == 'M' && tail+1 != head &&
+                    input_queue[(tail+1) % INPUT_QUEUE_SIZE].type == 'M') {
+                __atomic_add_fetch(&input_stats.coalesced, 1,
+                                   __ATOMIC_RELAXED);
+            } else {
+                inject_input(ev);
+                __atomic_add_fetch(&input_stats.injected, 1,
+                                   __ATOMIC_RELAXED);
+            }
+            /* Sequentially consistent with input_waiting: see
+             * wait_input_room. */
+            __atomic_store_n(&input_tail, ++tail, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&input_waiting, __ATOMIC_SEQ_CST) &&
+                    __atomic_exchange_n(&input_waiting, 0, __ATOMIC_SEQ_CST)) {
+                uint64_t one = 1;
+                trueorabort(write(input_room_fd, &one, sizeof(one)) ==
+                            sizeof(one), "write input_room_fd");
+            }
+        }
+        XFlush(input_dpy);
+    }
+    return NULL;
+}
+
+/* Wakes the input thread up, once events are queued */
+static void wake_input() {
+    uint64_t one = 1;
+    trueorabort(write(input_fd, &one, sizeof(one)) == sizeof(one),
+                "write input_fd");
+}
+
+/* Returns 1 if the input queue has no free slot */
+static int input_full() {
+    return input_head - __atomic_load_n(&input_tail, __ATOMIC_SEQ_CST) ==
+           INPUT_QUEUE_SIZE;
+}
+
+/* Asks the input thread to signal input_room_fd once it frees a slot.
+ * Returns 0 if there is room already. input_waiting is set before the queue
+ * is checked, and the input thread frees a slot before it checks
+ * input_waiting: either this sees the free slot, or the input thread sees
+ * the request. */
+static int request_input_room() {
+    __atomic_store_n(&input_waiting, 1, __ATOMIC_SEQ_CST);
+    if (!input_full()) {
+        __atomic_store_n(&input_waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    wake_input();
+    return 1;
+}
+
+/* Blocks until the input thread frees a slot in the queue */
+static void wait_input_room() {
+    uint64_t count;
+    log(1, "Input queue full.");
+    while (request_input_room()) {
+        if (read(input_room_fd, &count, sizeof(count)) < 0)
+            trueorabort(errno == EINTR, "read input_room_fd");
+    }
+}
+
+/* Appends ev to the queue, waiting for room if needed */
+static void push_input(const struct input_event* ev) {
+    if (input_full())
+        wait_input_room();
+    input_queue[input_head % INPUT_QUEUE_SIZE] = *ev;
+    __atomic_store_n(&input_head, input_head + 1, __ATOMIC_RELEASE);
+    input_queued = 1;
+}
+
+/* Queues the motion event held back while the queue was full, if there is
+ * room now. Otherwise, the main loop calls this again once input_room_fd is
+ * signaled. */
+static void queue_pending_motion() {
+    if (!motion_pending || request_input_room())
+        return;
+    motion_pending = 0;
+    push_input(&pending_motion);
+}
+
+/* Queues one event for the input thread. If the queue is full, motion events
+ * are held back, and replaced by the next one, as only the last position
+ * matters. Other events wait for the input thread to make room: they are never
+ * dropped, as a lost release would leave a key stuck. */
+static void queue_input(char type, uint8_t code, int down, int x, int y) {
+    struct input_event ev = {
+        .type = type, .code = code, .down = down, .x = x, .y = y,
+    };
+
+    if (type == 'M' && (motion_pending || input_full())) {
+        if (motion_pending)
+            __atomic_add_fetch(&input_stats.coalesced, 1, __ATOMIC_RELAXED);
+        pending_motion = ev;
+        motion_pending = 1;
+        queue_pending_motion();
+        return;
+    }
+
+    /* Clicks must happen where the pointer was moved before them */
+    if (motion_pending) {
+        motion_pending = 0;
+        push_input(&pending_motion);
+    }
+    push_input(&ev);
+}
+
+/* Wakes the input thread up, if events were queued. Events are only queued
+ * while the client packets that are already buffered are handled, so that
+ * the input thread sees (and coalesces) them all at once. */
+static void flush_input() {
+    if (input_queued) {
+        input_queued = 0;
+        wake_input();
+    }
+}
+
+/* Queues a single event, and sends it to the input thread right away */
+static void send_input(char type, uint8_t code, int down, int x, int y) {
+    queue_input(type, code, down, x, y);
+    flush_input();
+}
+
+/* Queues a batch of input events */
+static void replay_input(const struct input* in) {
+    int i;
+    for (i = 0; i < in->count; i++) {
+        const struct input_event* ev = &in->events[i];
+        if (i > 0)
+            log(3, "Input %c: +%u ms", ev->type, ev->time - in->events[0].time);
+        if (!strchr("KCM", ev->type) || ev->type == '\0') {
+            error("Invalid input event (%d).", ev->type);
+            continue;
+        }
+        queue_input(ev->type, ev->code, ev->down,
+                    ev->x*out_scale, ev->y*out_scale);
+    }
+}
+
+/* Opens the input connection to display name, and starts the input thread */
+static void input_init(char* name) {
+    input_dpy = XOpenDisplay(name);
+    trueorabort(input_dpy, "Cannot open input display.");
+    input_fd = eventfd(0, EFD_CLOEXEC);
+    trueorabort(input_fd >= 0, "eventfd");
+    input_room_fd = eventfd(0, EFD_CLOEXEC);
+    trueorabort(input_room_fd >= 0, "eventfd");
+    trueorabort(pthread_create(&input_thread, NULL, input_main, NULL) == 0,
+                "pthread_create");
+}
+
+/* Region functions */
+
+/* Returns 1 if rectangles a and b overlap or touch each other */
+static int rect_touch(const struct rect* a, const struct rect* b) {
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+           a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+/* Sets r to the bounding box of rectangles a and b (r may alias a or b) */
+static void rect_bound(struct rect* r,
+                       const struct rect* a, const struct rect* b) {
+    int x0 = a->x < b->x ? a->x : b->x;
+    int y0 = a->y < b->y ? a->y : b->y;
+    int x1 = a->x + a->width > b->x + b->width ?
+                 a->x + a->width : b->x + b->width;
+    int y1 = a->y + a->height > b->y + b->height ?
+                 a->y + a->height : b->y + b->height;
+    r->x = x0;
+    r->y = y0;
+    r->width = x1 - x0;
+    r->height = y1 - y0;
+}
+
+/* Sets region to cover the whole screen (width x height) */
+static void region_full(struct region* reg, int width, int height) {
+    reg->nrects = 1;
+    reg->rects[0].x = 0;
+    reg->rects[0].y = 0;
+    reg->rects[0].width = width;
+    reg->rects[0].height = height;
+}
+
+/* Adds a rectangle to region, after clipping it to the screen (width x
+ * height). Touching rectangles are merged into their bounding box. If the
+ * region is full, the rectangle is merged with the one that grows the least. */
+static void region_add(struct region* reg, int x, int y, int w, int h,
+                       int width, int height) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > width) w = width - x;
+    if (y + h > height) h = height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    struct rect r = { x, y, w, h };
+    int i = 0;
+    while (i < reg->nrects) {
+        if (rect_touch(&r, &reg->rects[i])) {
+            rect_bound(&r, &r, &reg->rects[i]);
+            reg->rects[i] = reg->rects[--reg->nrects];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (reg->nrects < MAX_RECTS) {
+        reg->rects[reg->nrects++] = r;
+        return;
+    }
+
+    int best = 0;
+    long bestgrowth = -1;
+    for (i = 0; i < reg->nrects; i++) {
+        struct rect b;
+        rect_bound(&b, &r, &reg->rects[i]);
+        long growth = (long)b.width*b.height -
+                      (long)reg->rects[i].width*reg->rects[i].height;
+        if (bestgrowth < 0 || growth < bestgrowth) {
+            best = i;
+            bestgrowth = growth;
+        }
+    }
+    rect_bound(&reg->rects[best], &reg->rects[best], &r);
+}
+
+/* Adds all rectangles of src to dst */
+static void region_union(struct region* dst, const struct region* src,
+                         int width, int height) {
+    int i;
+    for (i = 0; i < src->nrects; i++) {
+        const struct rect* r = &src->rects[i];
+        region_add(dst, r->x, r->y, r->width, r->height, width, height);
+    }
+}
+
 /* X11-related functions */
 
 static int xerror_handler(Display *dpy, XErrorEvent *e) {
@@ -162,9 +670,9 @@ static int init_display(char* name) {
         return -1;
     }
 
-    /* Get notified when new windows are created. */
+    /* Get notified when new windows are created, or the screen is resized. */
     Window root = DefaultRootWindow(dpy);
-    XSelectInput(dpy, root, SubstructureNotifyMask);
+    XSelectInput(dpy, root, SubstructureNotifyMask | StructureNotifyMask);
 
     /* Register damage events for existing windows */
     Window rootp, parent;
@@ -185,27 +693,223 @@ static int init_display(char* name) {
     /* Register for cursor events */
     XFixesSelectCursorInput(dpy, root, XFixesDisplayCursorNotifyMask);
 
+    /* Check if we can capture frames directly into client buffers */
+    shmfd = 0;
+#ifdef HAVE_SHM_FD
+    Bool pixmaps;
+    if (XShmQueryVersion(dpy, &major, &minor, &pixmaps) &&
+            (major > 1 || (major == 1 && minor >= 2))) {
+        shmfd = 1;
+    }
+#endif
+    log(1, "MIT-SHM fd passing %savailable.", shmfd ? "" : "not ");
+
+    return 0;
+}
+
+/* Resolution changes run on their own thread, with their own X connection,
+ * so that frames and input keep flowing while the mode is switched. Modes
+ * are created through XRandR (1.3 or later), setres is only used as a
+ * fallback (e.g. unpatched xorg-dummy). The result is sent to the client
+ * once the thread signals resize_fd (eventfd). */
+#define MODE_RATE 60  /* Refresh rate of the modes we create (Hz) */
+#define MODE_CACHE_SIZE 8
+static Display* resize_dpy;
+static pthread_t resize_thread;
+static int resize_fd = -1;
+static int randr;  /* XRandR 1.3 is available */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct resolution want;  /* Last request */
+    uint32_t serial;  /* Last request, only written by the main thread */
+    uint32_t started;  /* Last request picked up by the resize thread */
+    struct resolution result;
+    uint32_t result_serial;  /* Request result answers */
+} resize = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static uint32_t resize_discard;  /* Requests of a disconnected client */
+
+/* kiwi_WxH_R modes we created, kept around so that going back to a previous
+ * window size does not need a new mode (resize thread only). */
+static struct mode_entry {
+    RRMode id;  /* None if unused */
+    int width, height;
+    uint64_t used;
+} modes[MODE_CACHE_SIZE];
+static uint64_t mode_clock;
+
+/* Returns 1 if mode id still exists in res */
+static int mode_exists(XRRScreenResources* res, RRMode id) {
+    int i;
+    for (i = 0; i < res->nmode; i++) {
+        if (res->modes[i].id == id)
+            return 1;
+    }
     return 0;
 }
 
+/* Removes mode from output, and destroys it */
+static void destroy_mode(RROutput output, struct mode_entry* mode) {
+    log(2, "Removing mode %dx%d", mode->width, mode->height);
+    XRRDeleteOutputMode(resize_dpy, output, mode->id);
+    XRRDestroyMode(resize_dpy, mode->id);
+    mode->id = None;
+}
+
+/* Returns the cache entry for a width x height mode on output, creating the
+ * mode if needed. Sets created if the mode is new. */
+static struct mode_entry* get_mode(XRRScreenResources* res, RROutput output,
+                                   int width, int height, int* created) {
+    Window root = DefaultRootWindow(resize_dpy);
+    struct mode_entry* victim = &modes[0];
+    char name[32];
+    int i;
+
+    *created = 0;
+    for (i = 0; i < MODE_CACHE_SIZE; i++) {
+        struct mode_entry* mode = &modes[i];
+        /* Modes may be removed behind our back (e.g. by setres) */
+        if (mode->id != None && !mode_exists(res, mode->id))
+            mode->id = None;
+        if (mode->id != None && mode->width == width &&
+                mode->height == height)
+            return mode;
+        if (mode->id == None || (victim->id != None &&
+                                 mode->used < victim->used))
+            victim = mode;
+    }
+
+    /* Evict the least recently used mode. used is only bumped when a switch
+     * succeeds, so the current mode, if it is ours, is the most recently
+     * used one. */
+    if (victim->id != None)
+        destroy_mode(output, victim);
+
+    victim->width = width;
+    victim->height = height;
+    victim->used = 0;
+    snprintf(name, sizeof(name), "kiwi_%dx%d_%d", width, height, MODE_RATE);
+
+    /* A previous instance may have left the mode behind */
+    for (i = 0; i < res->nmode; i++) {
+        if (!strcmp(res->modes[i].name, name)) {
+            victim->id = res->modes[i].id;
+            XRRAddOutputMode(resize_dpy, output, victim->id);
+            return victim;
+        }
+    }
+
+    /* Same timings as setres on xiwi: no blanking (xorg-dummy does not care),
+     * and the dot clock rounded down to a whole MHz. */
+    XRRModeInfo* info = XRRAllocModeInfo(name, strlen(name));
+    info->width = info->hSyncStart = info->hSyncEnd = info->hTotal = width;
+    info->height = info->vSyncStart = info->vSyncEnd = info->vTotal = height;
+    info->dotClock = (unsigned long)MODE_RATE*width*height/1000000*1000000;
+    victim->id = XRRCreateMode(resize_dpy, root, info);
+    XRRFreeModeInfo(info);
+    XRRAddOutputMode(resize_dpy, output, victim->id);
+    *created = 1;
+    log(2, "Created mode %s", name);
+    return victim;
+}
+
+/* Sets the screen size, keeping the current DPI */
+static void set_screen_size(int width, int height) {
+    Display* d = resize_dpy;
+    int mmwidth = (double)width*DisplayWidthMM(d, 0)/DisplayWidth(d, 0);
+    int mmheight = (double)height*DisplayHeightMM(d, 0)/DisplayHeight(d, 0);
+    XRRSetScreenSize(d, DefaultRootWindow(d), width, height,
+                     mmwidth > 0 ? mmwidth : 1, mmheight > 0 ? mmheight : 1);
+}
+
+/* Switches the first output (primary output, if any) to a width x height
+ * mode, through XRandR. Returns 0 on success. */
+static int set_mode(int width, int height) {
+    Window root = DefaultRootWindow(resize_dpy);
+    XRRScreenResources* res = NULL;
+    XRROutputInfo* output_info = NULL;
+    XRRCrtcInfo* crtc_info = NULL;
+    XWindowAttributes attrib;
+    int ret = -1;
+
+    res = XRRGetScreenResourcesCurrent(resize_dpy, root);
+    if (!res || !XGetWindowAttributes(resize_dpy, root, &attrib))
+        goto out;
+
+    RROutput output = XRRGetOutputPrimary(resize_dpy, root);
+    if (output == None && res->noutput > 0)
+        output = res->outputs[0];
+    if (output != None)
+        output_info = XRRGetOutputInfo(resize_dpy, res, output);
+    if (!output_info)
+        goto out;
+    RRCrtc crtc = output_info->crtc;
+    if (crtc == None && output_info->ncrtc > 0)
+        crtc = output_info->crtcs[0];
+    if (crtc != None)
+        crtc_info = XRRGetCrtcInfo(resize_dpy, res, crtc);
+    if (!crtc_info) {
+        error("No CRTC for output %s.", output_info->name);
+        goto out;
+    }
+
+    int created;
+    struct mode_entry* mode = get_mode(res, output, width, height, &created);
+
+    /* The screen must contain the CRTC at all times: it grows before the
+     * mode is switched, and shrinks after. */
+    int grow = width > attrib.width || height > attrib.height;
+    if (grow) {
+        set_screen_size(width > attrib.width ? width : attrib.width,
+                        height > attrib.height ? height : attrib.height);
+    }
+
+    Status status = XRRSetCrtcConfig(resize_dpy, res, crtc, CurrentTime,
+                                     crtc_info->x, crtc_info->y, mode->id,
+                                     crtc_info->rotation, &output, 1);
+    if (status != RRSetConfigSuccess) {
+        error("Cannot switch to mode %dx%d (%d).", width, height, status);
+        if (grow)
+            set_screen_size(attrib.width, attrib.height);
+        if (created)
+            destroy_mode(output, mode);
+        goto out;
+    }
+
+    if (width != attrib.width || height != attrib.height)
+        set_screen_size(width, height);
+    mode->used = ++mode_clock;
+    ret = 0;
+
+out:
+    XSync(resize_dpy, False);
+    if (crtc_info)
+        XRRFreeCrtcInfo(crtc_info);
+    if (output_info)
+        XRRFreeOutputInfo(output_info);
+    if (res)
+        XRRFreeScreenResources(res);
+    return ret;
+}
+
 /* Changes resolution using external handler.
- * Reply must be a resolution in "canonical" form: <w>x<h>[_<rate>] */
-/* FIXME: Maybe errors here should not be fatal... */
-void change_resolution(const struct resolution* rin) {
+ * Reply must be a resolution in "canonical" form: <w>x<h>[_<rate>]
+ * Returns 0 on success, and sets r to the resolution that was applied. */
+static int run_setres(struct resolution* r) {
     /* Setup parameters and run command */
     char arg1[32], arg2[32];
-    int c;
-    c = snprintf(arg1, sizeof(arg1), "%d", rin->width);
-    trueorabort(c > 0, "snprintf");
-    c = snprintf(arg2, sizeof(arg2), "%d", rin->height);
-    trueorabort(c > 0, "snprintf");
+    snprintf(arg1, sizeof(arg1), "%d", r->width);
+    snprintf(arg2, sizeof(arg2), "%d", r->height);
 
     char* cmd = "setres";
     char* args[] = {cmd, arg1, arg2, NULL};
     char buffer[256];
     log(2, "Running %s %s %s", cmd, arg1, arg2);
-    c = popen2(cmd, args, NULL, 0, buffer, sizeof(buffer));
-    trueorabort(c > 0, "popen2");
+    int c = popen2(cmd, args, NULL, 0, buffer, sizeof(buffer));
+    if (c <= 0) {
+        error("%s failed.", cmd);
+        return -1;
+    }
 
     /* Parse output */
     buffer[c < sizeof(buffer) ? c : (sizeof(buffer)-1)] = 0;
@@ -213,267 +917,1354 @@ void change_resolution(const struct resolution* rin) {
     char* cut = strchr(buffer, '_');
     if (cut) *cut = 0;
     cut = strchr(buffer, 'x');
-    trueorabort(cut, "Invalid answer: %s", buffer);
+    if (!cut) {
+        error("Invalid answer: %s", buffer);
+        return -1;
+    }
     *cut = 0;
 
     char* endptr;
     long nwidth = strtol(buffer, &endptr, 10);
-    trueorabort(buffer != endptr && *endptr == '\0',
-                "Invalid width: '%s'", buffer);
+    if (buffer == endptr || *endptr != '\0') {
+        error("Invalid width: '%s'", buffer);
+        return -1;
+    }
     long nheight = strtol(cut+1, &endptr, 10);
-    trueorabort(cut+1 != endptr && (*endptr == '\0' || *endptr == '\n'),
-                "Invalid height: '%s'", cut+1);
-    log(1, "New resolution %ld x %ld", nwidth, nheight);
+    if (cut+1 == endptr || (*endptr != '\0' && *endptr != '\n')) {
+        error("Invalid height: '%s'", cut+1);
+        return -1;
+    }
 
-    char reply_raw[FRAMEMAXHEADERSIZE + sizeof(struct resolution)];
-    struct resolution* r = (struct resolution*)(reply_raw + FRAMEMAXHEADERSIZE);
-    r->type = 'R';
     r->width = nwidth;
     r->height = nheight;
-    socket_client_write_frame(reply_raw, sizeof(*r), WS_OPCODE_BINARY, 1);
+    return 0;
 }
 
-/* Closes the mmap/fd in the entry. */
-void close_mmap(struct cache_entry* entry) {
-    if (!entry->map)
+/* Applies a resolution change (resize thread). If it fails, r is set to the
+ * current screen size, so that the client can adjust to it. */
+static void change_resolution(struct resolution* r) {
+    if ((randr && set_mode(r->width, r->height) == 0) || run_setres(r) == 0) {
+        log(1, "New resolution %d x %d", r->width, r->height);
+        return;
+    }
+
+    XWindowAttributes attrib;
+    if (XGetWindowAttributes(resize_dpy, DefaultRootWindow(resize_dpy),
+                             &attrib)) {
+        r->width = attrib.width;
+        r->height = attrib.height;
+    }
+    error("Cannot change resolution, keeping %d x %d.", r->width, r->height);
+}
+
+/* Resize thread: applies the last requested resolution, and signals the
+ * main thread. Requests that come in meanwhile are merged. */
+static void* resize_main(void* arg) {
+    pthread_mutex_lock(&resize.lock);
+    while (1) {
+        while (resize.started == resize.serial)
+            pthread_cond_wait(&resize.cond, &resize.lock);
+        struct resolution r = resize.want;
+        uint32_t serial = resize.started = resize.serial;
+        pthread_mutex_unlock(&resize.lock);
+
+        change_resolution(&r);
+
+        pthread_mutex_lock(&resize.lock);
+        resize.result = r;
+        resize.result_serial = serial;
+        uint64_t one = 1;
+        if (write(resize_fd, &one, sizeof(one)) < 0)
+            syserror("Cannot signal resolution change.");
+    }
+    return NULL;
+}
+
+/* Asks the resize thread for a new resolution */
+static void request_resolution(const struct resolution* r) {
+    pthread_mutex_lock(&resize.lock);
+    resize.want = *r;
+    resize.serial++;
+    pthread_cond_signal(&resize.cond);
+    pthread_mutex_unlock(&resize.lock);
+}
+
+/* Replies to the client, once its last resolution request is applied */
+static void finish_resolution() {
+    uint64_t count;
+    if (read(resize_fd, &count, sizeof(count)) < 0)
         return;
 
-    log(2, "Closing mmap %p %zu %d", entry->map, entry->length, entry->fd);
-    munmap(entry->map, entry->length);
-    close(entry->fd);
-    entry->map = NULL;
+    pthread_mutex_lock(&resize.lock);
+    struct resolution r = resize.result;
+    int done = resize.result_serial == resize.serial;
+    pthread_mutex_unlock(&resize.lock);
+
+    /* Older requests were superseded, and the client does not expect a reply
+     * to the requests of the previous connection. */
+    if (!done || resize.serial == resize_discard)
+        return;
+    r.type = 'R';
+    socket_client_write_frame((char*)&r, sizeof(r), WS_OPCODE_BINARY, 1);
 }
 
-/* Read the pid of nacl_helper and get shm from findnacl daemon.
- * The socket fd is passed in and fd of nacl_helper is returned..*/
-int recv_pid_fd(int conn)
-{
-    int fd = -1;
+/* Opens the resize connection to display name, and starts the resize
+ * thread */
+static void resize_init(char* name) {
+    int event, error, major = 0, minor = 0;
+    resize_dpy = XOpenDisplay(name);
+    trueorabort(resize_dpy, "Cannot open resize display.");
+    randr = XRRQueryExtension(resize_dpy, &event, &error) &&
+            XRRQueryVersion(resize_dpy, &major, &minor) &&
+            (major > 1 || (major == 1 && minor >= 3));
+    log(1, "XRandR %d.%d: %s resolution changes.", major, minor,
+        randr ? "native" : "setres");
+
+    resize_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    trueorabort(resize_fd >= 0, "eventfd");
+    trueorabort(pthread_create(&resize_thread, NULL, resize_main, NULL) == 0,
+                "pthread_create");
+}
+
+/* Connects to the findnacl daemon, if needed. Returns 0 on success. */
+static int findnacl_connect() {
+    struct sockaddr_un addr;
+
+    if (findnacl_fd >= 0)
+        return 0;
+
+    findnacl_fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if (findnacl_fd < 0) {
+        syserror("Cannot create socket.");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, findnacl_path, sizeof(addr.sun_path) - 1);
+
+    if (connect(findnacl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        syserror("Cannot connect to findnacl daemon.");
+        close(findnacl_fd);
+        findnacl_fd = -1;
+        return -1;
+    }
+
+    /* Replies to lookups in flight are handled by the main loop */
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = findnacl_fd };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, findnacl_fd, &ev) < 0)
+        syserror("Cannot add findnacl socket to epoll.");
+
+    return 0;
+}
+
+/* Drops the connection to the findnacl daemon: all lookups in flight fail. */
+static void findnacl_disconnect() {
+    int i;
+    close(findnacl_fd);
+    findnacl_fd = -1;
+    for (i = 0; i < MAX_LOOKUPS; i++) {
+        if (lookups[i].id && !lookups[i].done) {
+            lookups[i].done = 1;
+            lookups[i].fd = -1;
+        }
+    }
+}
+
+static struct lookup* findnacl_slot(uint32_t id) {
+    int i;
+    for (i = 0; i < MAX_LOOKUPS; i++) {
+        if (lookups[i].id == id)
+            return &lookups[i];
+    }
+    return NULL;
+}
+
+/* Receives one reply from the findnacl daemon, and stores the shm fd in the
+ * matching lookup slot. Returns 0 on success, -1 on error. */
+static int findnacl_recv() {
+    struct findnacl_reply reply;
     struct msghdr msg = { 0 };
     struct iovec iov;
     struct cmsghdr *cmsg;
-    long pid;
     char buf[CMSG_SPACE(sizeof(int))];
+    int fd = -1;
 
     memset(buf, 0, sizeof(buf));
 
-    iov.iov_base = &pid;
-    iov.iov_len = sizeof(pid);
+    iov.iov_base = &reply;
+    iov.iov_len = sizeof(reply);
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
     msg.msg_control = buf;
     msg.msg_controllen = CMSG_SPACE(sizeof(int));
 
-    if (recvmsg(conn, &msg, 0) < 0) {
-        syserror("Cannot get response from findnacl daemon.");
+    int c = recvmsg(findnacl_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (c != sizeof(reply) || reply.type != 'F') {
+        if (c < 0)
+            syserror("Cannot get response from findnacl daemon.");
+        else
+            error("Invalid response from findnacl daemon (%d bytes).", c);
+        findnacl_disconnect();
         return -1;
     }
 
     cmsg = CMSG_FIRSTHDR(&msg);
-    if (cmsg) {
-        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
-            fd = *((int *)CMSG_DATA(cmsg));
-        } else {
-            error("No fd is passed from findnacl daemon.");
-        }
-    } else {
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+        fd = *((int *)CMSG_DATA(cmsg));
+    } else if (reply.pid > 0) {
         error("No fd is passed from findnacl daemon.");
     }
-    return fd;
-}
 
-/* Finds NaCl/Chromium shm memory using external handler.
- * Reply must be in the form PID:file */
-struct cache_entry* find_shm(uint64_t paddr, uint64_t sig, size_t length) {
-    struct cache_entry* entry = NULL;
-
-    /* Find entry in cache */
-    if (cache[0].paddr == paddr) {
-        entry = &cache[0];
-    } else if (cache[1].paddr == paddr) {
-        entry = &cache[1];
-    } else {
-        /* Not found: erase an existing entry. */
-        entry = &cache[next_entry];
-        next_entry = (next_entry + 1) % 2;
-        close_mmap(entry);
+    struct lookup* slot = findnacl_slot(reply.id);
+    if (!slot || slot->done) {
+        /* Lookup was cancelled */
+        if (fd >= 0)
+            close(fd);
+        return 0;
     }
 
-    int try;
-    for (try = 0; try < 2; try++) {
-        /* Check signature */
-        if (entry->map) {
-            if (*((uint64_t*)entry->map) == sig)
-                return entry;
-
-            log(1, "Invalid signature, fetching new shm!");
-            close_mmap(entry);
-        }
+    log(2, "Lookup %u: pid %d, fd %d", reply.id, reply.pid, fd);
+    slot->done = 1;
+    slot->pid = reply.pid;
+    slot->fd = fd;
+    return 0;
+}
 
-        /* Setup parameters and run command */
-        char arg1[32], arg2[32];
-        int c;
+/* Forgets about lookup id, closing the fd it returned, if any. */
+static void findnacl_discard(uint32_t id) {
+    struct lookup* slot;
+    if (!id || !(slot = findnacl_slot(id)))
+        return;
+    if (slot->done && slot->fd >= 0)
+        close(slot->fd);
+    slot->id = 0;
+}
 
-        c = snprintf(arg1, sizeof(arg1), "%08lx", (long)paddr & 0xffffffff);
-        trueorabort(c > 0, "snprintf");
-        int i, p = 0;
-        for (i = 0; i < 8; i++) {
-            c = snprintf(arg2 + p, sizeof(arg2) - p, "%02x",
-                         ((uint8_t*)&sig)[i]);
-            trueorabort(c > 0, "snprintf");
-            p += c;
-        }
+/* Waits for the reply to lookup id, and frees its slot.
+ * Returns the shm fd, and sets pid, on success. Returns -1 on error. */
+static int findnacl_wait(uint32_t id, int* pid) {
+    struct lookup* slot = findnacl_slot(id);
+    if (!id || !slot)
+        return -1;
 
-        int sock;
-        struct sockaddr_un addr;
+    while (!slot->done) {
+        if (findnacl_recv() < 0)
+            break;
+    }
 
-        sock = socket(AF_UNIX, SOCK_STREAM, 0);
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path));
+    int fd = slot->done ? slot->fd : -1;
+    *pid = slot->pid;
+    slot->id = 0;
+    return fd;
+}
 
-        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-            syserror("Cannot connect to findnacl daemon.");
-            return NULL;
+/* Sends a lookup request for the shm at paddr, with the given signature,
+ * without waiting for the reply. Returns the request id, 0 on error. */
+static uint32_t findnacl_send(uint64_t paddr, uint64_t sig) {
+    struct lookup* slot = findnacl_slot(0);
+    if (!slot) {
+        /* Too many lookups in flight: drop the oldest one */
+        int i;
+        slot = &lookups[0];
+        for (i = 1; i < MAX_LOOKUPS; i++) {
+            if (lookups[i].id - findnacl_id < slot->id - findnacl_id)
+                slot = &lookups[i];
         }
+        log(1, "Dropping lookup %u.", slot->id);
+        findnacl_discard(slot->id);
+    }
 
-        char args[70];
-        c = snprintf(args, sizeof(args), "%s %s", arg1, arg2);
-        trueorabort(c > 0 && c < sizeof(args), "snprintf");
-
-        if (write(sock, args, strlen(args)) < 0) {
-            syserror("Cannot send arguments.");
-            close(sock);
-            return NULL;
-        }
+    if (findnacl_connect() < 0)
+        return 0;
 
-        entry->fd = recv_pid_fd(sock);
-        if (entry->fd < 0) {
-            error("Cannot open nacl file.");
-            return NULL;
-        }
-        close(sock);
+    struct findnacl_request req = { 0 };
+    req.type = 'F';
+    /* Never use 0 as an id */
+    if (++findnacl_id == 0)
+        ++findnacl_id;
+    req.id = findnacl_id;
+    req.paddr = paddr;
+    req.sig = sig;
+
+    if (send(findnacl_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+        syserror("Cannot send request.");
+        findnacl_disconnect();
+        return 0;
+    }
 
-        entry->paddr = paddr;
+    slot->id = req.id;
+    slot->done = 0;
+    slot->fd = -1;
+    return req.id;
+}
 
-        entry->length = length;
-        entry->map = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED,
-                          entry->fd, 0);
-        if (!entry->map) {
-            error("Cannot mmap.");
-            close(entry->fd);
-            return NULL;
-        }
+/* Attaches the fd in the entry to the X server, so that frames can be
+ * captured directly into the client buffer. On failure, the entry falls back
+ * to copying from our own segment. */
+static void attach_shm(struct cache_entry* entry) {
+    entry->shminfo.shmseg = 0;
+#ifdef HAVE_SHM_FD
+    if (!shmfd)
+        return;
 
-        log(2, "mmap ok %p %zu %d", entry->map, entry->length, entry->fd);
+    xcb_connection_t* conn = XGetXCBConnection(dpy);
+    /* XCB closes the fd once it is sent */
+    int fd = dup(entry->fd);
+    if (fd < 0) {
+        syserror("Cannot dup fd.");
+        return;
+    }
+    uint32_t seg = xcb_generate_id(conn);
+    xcb_generic_error_t* err =
+        xcb_request_check(conn, xcb_shm_attach_fd_checked(conn, seg, fd, 0));
+    if (err) {
+        error("Cannot attach shm fd (error %d), copying frames.",
+              err->error_code);
+        free(err);
+        return;
     }
 
-    error("Cannot find shm.");
-    return NULL;
+    entry->shminfo.shmseg = seg;
+    entry->shminfo.shmaddr = entry->map;
+    entry->shminfo.readOnly = False;
+    log(2, "Attached %p as segment %x", entry->map, seg);
+#endif
 }
 
-/* WebSocket functions */
-
-XImage* img = NULL;
-XShmSegmentInfo shminfo;
-
-/* Writes framebuffer image to websocket/shm */
-int write_image(const struct screen* screen) {
-    char reply_raw[FRAMEMAXHEADERSIZE + sizeof(struct screen_reply)];
-    struct screen_reply* reply =
-        (struct screen_reply*)(reply_raw + FRAMEMAXHEADERSIZE);
-    int refresh = 0;
+/* Closes the mmap/fd in the entry, and cancels its pending lookup. */
+void close_mmap(struct cache_entry* entry) {
+    findnacl_discard(entry->lookup);
+    entry->lookup = 0;
+    if (!entry->map)
+        return;
 
-    memset(reply_raw, 0, sizeof(reply_raw));
+    log(2, "Closing mmap %p %zu %d", entry->map, entry->length, entry->fd);
+#ifdef HAVE_SHM_FD
+    if (entry->shminfo.shmseg) {
+        xcb_shm_detach(XGetXCBConnection(dpy), entry->shminfo.shmseg);
+        entry->shminfo.shmseg = 0;
+    }
+#endif
+    munmap(entry->map, entry->length);
+    close(entry->fd);
+    entry->map = NULL;
+}
 
-    reply->type = 'S';
-    reply->width = screen->width;
-    reply->height = screen->height;
+/* Starts looking up the NaCl/Chromium shm memory at paddr for entry. The
+ * reply is only read when the entry is needed, in map_shm. */
+static void start_lookup(struct cache_entry* entry,
+                         uint64_t paddr, uint64_t sig, size_t length) {
+    close_mmap(entry);
+    entry->paddr = paddr;
+    entry->length = length;
+    entry->lookup = findnacl_send(paddr, sig);
+}
 
-    /* Allocate XShmImage */
-    if (!img || img->width != screen->width || img->height != screen->height) {
-        if (img) {
-            XDestroyImage(img);
-            shmdt(shminfo.shmaddr);
-            shmctl(shminfo.shmid, IPC_RMID, 0);
-        }
-
-        /* FIXME: Some error checking should happen here... */
-        img = XShmCreateImage(dpy, DefaultVisual(dpy, 0), 24,
-                              ZPixmap, NULL, &shminfo,
-                              screen->width, screen->height);
-        trueorabort(img, "XShmCreateImage");
-        shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line*img->height,
-                               IPC_CREAT|0777);
-        trueorabort(shminfo.shmid != -1, "shmget");
-        shminfo.shmaddr = img->data = shmat(shminfo.shmid, 0, 0);
-        trueorabort(shminfo.shmaddr != (void*)-1, "shmat");
-        shminfo.readOnly = False;
-        int ret = XShmAttach(dpy, &shminfo);
-        trueorabort(ret, "XShmAttach");
-        /* Force refresh */
-        refresh = 1;
+/* Waits for the lookup in flight for entry, and maps the shm. */
+static void finish_lookup(struct cache_entry* entry) {
+    entry->fd = findnacl_wait(entry->lookup, &entry->pid);
+    entry->lookup = 0;
+    if (entry->fd < 0) {
+        error("Cannot open nacl file.");
+        return;
     }
 
-    if (screen->refresh) {
-        log(1, "Force refresh from client.");
-        /* refresh forced by the client */
-        refresh = 1;
+    entry->map = mmap(NULL, entry->length, PROT_READ|PROT_WRITE, MAP_SHARED,
+                      entry->fd, 0);
+    if (entry->map == MAP_FAILED) {
+        syserror("Cannot mmap.");
+        entry->map = NULL;
+        close(entry->fd);
+        return;
     }
 
-    XEvent ev;
-    /* Register damage on new windows */
-    while (XCheckTypedEvent(dpy, MapNotify, &ev)) {
-        register_damage(dpy, ev.xcreatewindow.window);
-        refresh = 1;
-    }
+    /* Shared memory (tmpfs) does not need msync */
+    struct statfs fs;
+    entry->sync = fstatfs(entry->fd, &fs) < 0 || fs.f_type != TMPFS_MAGIC;
 
-    /* Check for damage */
-    while (XCheckTypedEvent(dpy, damageEvent + XDamageNotify, &ev)) {
-        refresh = 1;
-    }
+    entry->stale = 1;
+    entry->dirty.nrects = 0;
+    attach_shm(entry);
 
-    /* Check for cursor events */
-    reply->cursor_updated = 0;
-    while (XCheckTypedEvent(dpy, fixesEvent + XFixesCursorNotify, &ev)) {
-        XFixesCursorNotifyEvent* curev = (XFixesCursorNotifyEvent*)&ev;
-        if (verbose >= 2) {
-            char* name = XGetAtomName(dpy, curev->cursor_name);
-            log(2, "cursor! %ld %s", curev->cursor_serial, name);
-            XFree(name);
-        }
-        reply->cursor_updated = 1;
-        reply->cursor_serial = curev->cursor_serial;
+    log(2, "mmap ok %p %zu %d", entry->map, entry->length, entry->fd);
+}
+
+/* Maps the entries whose lookup was answered by the findnacl daemon, so
+ * that buffers announced by the client are ready before the next frame.
+ * Returns the number of lookups still in flight. */
+static int complete_lookups() {
+    int i, pending = 0;
+    for (i = 0; i < CACHE_SIZE + MAX_BUFFERS; i++) {
+        struct cache_entry* entry =
+            i < CACHE_SIZE ? &cache[i] : &ring[i-CACHE_SIZE];
+        if (!entry->lookup)
+            continue;
+        struct lookup* slot = findnacl_slot(entry->lookup);
+        if (!slot || slot->done)
+            finish_lookup(entry);
+        else
+            pending++;
     }
+    return pending;
+}
 
-    /* No update */
-    if (!refresh) {
-        reply->shm = 0;
-        reply->updated = 0;
-        socket_client_write_frame(reply_raw, sizeof(*reply),
-                                  WS_OPCODE_BINARY, 1);
-        return 0;
+/* Makes sure entry maps the NaCl/Chromium shm memory at paddr, with the
+ * given signature, using the findnacl daemon if needed.
+ * Returns entry on success, NULL on error. */
+struct cache_entry* map_shm(struct cache_entry* entry,
+                            uint64_t paddr, uint64_t sig, size_t length) {
+    /* Complete the lookup started on registration, if any */
+    if (entry->lookup)
+        finish_lookup(entry);
+
+    /* Check signature */
+    if (entry->map) {
+        if (*((uint64_t*)entry->map) == sig)
+            return entry;
+
+        log(1, "Invalid signature, fetching new shm!");
     }
 
-    /* Get new image from framebuffer */
-    XShmGetImage(dpy, DefaultRootWindow(dpy), img, 0, 0, AllPlanes);
+    start_lookup(entry, paddr, sig, length);
+    finish_lookup(entry);
+    if (entry->map && *((uint64_t*)entry->map) == sig)
+        return entry;
 
-    int size = img->bytes_per_line * img->height;
+    error("Cannot find shm.");
+    return NULL;
+}
 
-    trueorabort(size == screen->width*screen->height*4,
-                "Invalid screen byte count");
+/* Unmaps entry if its nacl_helper process is gone: the mapping still holds
+ * the old buffer, which nobody will read. Its pid may also be reused by an
+ * unrelated process later. Returns 1 if the entry was dropped. */
+static int drop_if_orphan(struct cache_entry* entry) {
+    if (!entry->map || kill(entry->pid, 0) == 0 || errno != ESRCH)
+        return 0;
+    log(2, "nacl_helper %d is gone, dropping %p.",
+        entry->pid, (void*)entry->paddr);
+    close_mmap(entry);
+    return 1;
+}
 
-    trueorabort(screen->shm, "Non-SHM rendering is not supported");
+/* Picks the cache entry to replace: a free one, one whose nacl_helper
+ * process is gone, or the least recently used one. */
+static struct cache_entry* cache_victim() {
+    struct cache_entry* victim = NULL;
+    int i;
+    for (i = 0; i < CACHE_SIZE; i++) {
+        struct cache_entry* entry = &cache[i];
+        if (!entry->map || drop_if_orphan(entry))
+            return entry;
+        if (!victim || entry->used < victim->used)
+            victim = entry;
+    }
+    cache_stats.evictions++;
+    log(2, "Evicting %p.", (void*)victim->paddr);
+    close_mmap(victim);
+    return victim;
+}
+
+/* Finds NaCl/Chromium shm memory, in the cache or using the findnacl
+ * daemon. */
+struct cache_entry* find_shm(uint64_t paddr, uint64_t sig, size_t length) {
+    struct cache_entry* entry = NULL;
+    int i;
+
+    for (i = 0; i < CACHE_SIZE; i++) {
+        if (cache[i].map && cache[i].paddr == paddr) {
+            entry = &cache[i];
+            break;
+        }
+    }
+
+    /* A restarted NaCl module may allocate a buffer at the same address,
+     * with the same signature (kiwi does not seed rand()): the mapping of
+     * the old process would still match. */
+    if (entry)
+        drop_if_orphan(entry);
+
+    if (entry && entry->map && *((uint64_t*)entry->map) == sig) {
+        cache_stats.hits++;
+    } else {
+        /* A signature mismatch means that the buffer at that address was
+         * freed, and a new one allocated: the entry is looked up again. */
+        cache_stats.misses++;
+        if (!entry)
+            entry = cache_victim();
+        log(2, "Cache miss %p (hits %lu, misses %lu, evictions %lu)",
+            (void*)paddr, cache_stats.hits, cache_stats.misses,
+            cache_stats.evictions);
+    }
+
+    entry->used = ++cache_clock;
+    return map_shm(entry, paddr, sig, length);
+}
+
+/* Registers a client buffer in the ring, and starts looking it up right
+ * away, so that the lookup is not on the critical path of the next frame.
+ * Lookups for all the buffers in the ring are in flight at the same time. */
+void register_buffer(const struct buffer* b) {
+    if (b->index >= MAX_BUFFERS) {
+        error("Invalid buffer index %d.", b->index);
+        return;
+    }
+
+    log(2, "Buffer %d: %p", b->index, (void*)b->paddr);
+    start_lookup(&ring[b->index], b->paddr, b->sig, b->width*b->height*4);
+}
+
+/* WebSocket functions */
+
+XImage* img = NULL;
+XShmSegmentInfo shminfo;
+/* Areas of img that are out of date */
+struct region img_dirty;
+/* Pixel format of img */
+static struct pixel_format img_format;
+
+/* Unless the client can take img as is (see native_output), img is converted
+ * into conv, which has the size of the client buffers. */
+static char* conv;
+static int conv_width, conv_height;
+static struct region conv_dirty;  /* Areas of conv that are out of date */
+static uint32_t* conv_rows;  /* 3 rows of img->width pixels per band */
+
+/* Returns CLOCK_MONOTONIC time, in ns. */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Timing histograms of each stage (see STATS_* in fbserver-proto.h) */
+static struct {
+    uint64_t total_us[STATS_STAGES];
+    uint32_t counts[STATS_STAGES][STATS_BUCKETS];
+} timings;
+static const char* stage_names[STATS_STAGES] = {
+    "events", "find_shm", "capture", "convert", "copy", "reply",
+    "frame"
+};
+
+/* Records a stage that started at start (from now_ns). Returns the current
+ * time, so that the next stage can start from there. */
+static uint64_t stats_add(int stage, uint64_t start) {
+    uint64_t now = now_ns();
+    uint64_t us = (now - start) / 1000;
+    int bucket = us > 0 ? 63 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    timings.counts[stage][bucket]++;
+    timings.total_us[stage] += us;
+    return now;
+}
+
+/* Prints the histograms (SIGUSR1), one line per stage that was timed */
+static void stats_dump() {
+    int i, j;
+    for (i = 0; i < STATS_STAGES; i++) {
+        char line[512] = "";
+        int len = 0;
+        uint64_t count = 0;
+        for (j = 0; j < STATS_BUCKETS; j++) {
+            uint32_t n = timings.counts[i][j];
+            count += n;
+            if (n > 0 && len < sizeof(line))
+                len += snprintf(line + len, sizeof(line) - len,
+                                " <%lluus:%u", 2ULL << j, n);
+        }
+        if (count > 0) {
+            log(0, "%-8s %8llu, avg %6llu us:%s", stage_names[i],
+                (unsigned long long)count,
+                (unsigned long long)(timings.total_us[i] / count), line);
+        }
+    }
+    log(0, "input    %8u injected, %u coalesced",
+        __atomic_load_n(&input_stats.injected, __ATOMIC_RELAXED),
+        __atomic_load_n(&input_stats.coalesced, __ATOMIC_RELAXED));
+}
+
+/* Sends timing statistics to the client */
+static void write_stats(const struct stats* t) {
+    struct stats_reply reply;
+    reply.type = 'T';
+    reply.stages = STATS_STAGES;
+    reply.buckets = STATS_BUCKETS;
+    memcpy(reply.total_us, timings.total_us, sizeof(reply.total_us));
+    memcpy(reply.counts, timings.counts, sizeof(reply.counts));
+    uint32_t injected = __atomic_load_n(&input_stats.injected,
+                                        __ATOMIC_RELAXED);
+    uint32_t coalesced = __atomic_load_n(&input_stats.coalesced,
+                                         __ATOMIC_RELAXED);
+    reply.input_injected = injected - input_stats_base.injected;
+    reply.input_coalesced = coalesced - input_stats_base.coalesced;
+    socket_client_write_frame((char*)&reply, sizeof(reply),
+                              WS_OPCODE_BINARY, 1);
+    if (t->reset) {
+        memset(&timings, 0, sizeof(timings));
+        input_stats_base.injected = injected;
+        input_stats_base.coalesced = coalesced;
+    }
+}
+
+/* (Re)allocates img, if its size is not width x height. Returns 1 if img
+ * was allocated: its content is then out of date. */
+static int alloc_image(int width, int height) {
+    if (img && img->width == width && img->height == height)
+        return 0;
+
+    if (img) {
+        XDestroyImage(img);
+        shmdt(shminfo.shmaddr);
+        shmctl(shminfo.shmid, IPC_RMID, 0);
+    }
+
+    /* FIXME: Some error checking should happen here... */
+    img = XShmCreateImage(dpy, DefaultVisual(dpy, 0), DefaultDepth(dpy, 0),
+                          ZPixmap, NULL, &shminfo, width, height);
+    trueorabort(img, "XShmCreateImage");
+    shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line*img->height,
+                           IPC_CREAT|0777);
+    trueorabort(shminfo.shmid != -1, "shmget");
+    shminfo.shmaddr = img->data = shmat(shminfo.shmid, 0, 0);
+    trueorabort(shminfo.shmaddr != (void*)-1, "shmat");
+    shminfo.readOnly = False;
+    int ret = XShmAttach(dpy, &shminfo);
+    trueorabort(ret, "XShmAttach");
+    region_full(&img_dirty, width, height);
+
+    img_format.bits_per_pixel = img->bits_per_pixel;
+    img_format.red_mask = img->red_mask;
+    img_format.green_mask = img->green_mask;
+    img_format.blue_mask = img->blue_mask;
+    if (img->bits_per_pixel == 32 && img->red_mask == 0xff0000 &&
+            img->green_mask == 0xff00 && img->blue_mask == 0xff) {
+        img_format.pixels = PIXELS_BGRX;
+    } else if (img->bits_per_pixel == 16 && img->red_mask == 0xf800 &&
+               img->green_mask == 0x07e0 && img->blue_mask == 0x001f) {
+        img_format.pixels = PIXELS_RGB565;
+    } else {
+        trueorabort(img->bits_per_pixel == 32 || img->bits_per_pixel == 16,
+                    "Unsupported pixel format (%d bpp)", img->bits_per_pixel);
+        img_format.pixels = PIXELS_OTHER;
+    }
+    log(1, "Screen: %dx%d, %d bpp, %d bytes per line", width, height,
+        img->bits_per_pixel, img->bytes_per_line);
+
+    free(conv_rows);
+    conv_rows = malloc((MAX_WORKERS+1)*3*width*sizeof(*conv_rows));
+    trueorabort(conv_rows, "malloc");
+    return 1;
+}
+
+/* Captures the rows covered by region into dst, which has the same geometry
+ * as img. Rows are fetched in bands covering the full screen width, so that
+ * XShmGetImage writes the data at the right place in dst: this is one request
+ * per set of overlapping rows. */
+static void capture_region(XImage* dst, const struct region* reg) {
+    int y0[MAX_RECTS], y1[MAX_RECTS];
+    int nbands = 0;
+    int i, j;
+
+    /* Sort bands by starting row (insertion sort, there are few of them) */
+    for (i = 0; i < reg->nrects; i++) {
+        int top = reg->rects[i].y;
+        int bottom = top + reg->rects[i].height;
+        for (j = nbands; j > 0 && y0[j-1] > top; j--) {
+            y0[j] = y0[j-1];
+            y1[j] = y1[j-1];
+        }
+        y0[j] = top;
+        y1[j] = bottom;
+        nbands++;
+    }
+
+    i = 0;
+    while (i < nbands) {
+        int top = y0[i], bottom = y1[i];
+        for (i++; i < nbands && y0[i] <= bottom; i++) {
+            if (y1[i] > bottom)
+                bottom = y1[i];
+        }
+
+        /* Shallow copy of dst, restricted to the band */
+        XImage band = *dst;
+        band.height = bottom - top;
+        band.data = dst->data + top*dst->bytes_per_line;
+        XShmGetImage(dpy, DefaultRootWindow(dpy), &band, 0, top, AllPlanes);
+        log(3, "band %d-%d", top, bottom);
+    }
+}
+
+/* Worker pool functions */
+
+/* Runs band of job: the rows of the rectangles, taken in order, from
+ * band/nbands to (band+1)/nbands of the total. */
+static void job_band(const struct job* job, int band) {
+    const struct region* reg = &job->region;
+    int total = 0, pos = 0;
+    int i;
+
+    for (i = 0; i < reg->nrects; i++)
+        total += reg->rects[i].height;
+    int first = (int64_t)total*band/job->nbands;
+    int last = (int64_t)total*(band+1)/job->nbands;
+
+    for (i = 0; i < reg->nrects && pos < last; i++) {
+        const struct rect* r = &reg->rects[i];
+        int y0 = first > pos ? first - pos : 0;
+        int y1 = last - pos < r->height ? last - pos : r->height;
+        if (y0 < y1)
+            job->rows(job, band, r, r->y + y0, r->y + y1);
+        pos += r->height;
+    }
+}
+
+/* Worker thread: runs band (its index) of every job */
+static void* worker_main(void* arg) {
+    int band = (intptr_t)arg;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (pool_job.generation == generation)
+            pthread_cond_wait(&pool_start, &pool_lock);
+        generation = pool_job.generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        job_band(&pool_job, band);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_job.pending == 0) {
+            if (pool_job.background) {
+                uint64_t one = 1;
+                if (write(pool_fd, &one, sizeof(one)) < 0)
+                    syserror("Cannot signal completion.");
+            }
+            pthread_cond_broadcast(&pool_done);
+        }
+    }
+    return NULL;
+}
+
+/* Starts the worker threads */
+static void pool_init() {
+    int i;
+    if (nworkers < 0)
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (nworkers < 0)
+        nworkers = 0;
+    if (nworkers > MAX_WORKERS)
+        nworkers = MAX_WORKERS;
+
+    pool_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    trueorabort(pool_fd >= 0, "eventfd");
+    for (i = 0; i < nworkers; i++) {
+        trueorabort(pthread_create(&workers[i], NULL, worker_main,
+                                   (void*)(intptr_t)i) == 0,
+                    "pthread_create");
+    }
+    log(1, "%d worker threads", nworkers);
+}
+
+/* Waits until the workers are done with the current job */
+static void pool_wait() {
+    pthread_mutex_lock(&pool_lock);
+    while (pool_job.pending > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Runs job, split across the workers if it is large enough. In the
+ * background, returns 1 if the job is still running: completion is then
+ * signalled on pool_fd. Otherwise, returns 0 once the job is done. */
+static int pool_run(const struct job* job, int background) {
+    size_t bytes = 0;
+    int i;
+
+    for (i = 0; i < job->region.nrects; i++) {
+        const struct rect* r = &job->region.rects[i];
+        bytes += (size_t)r->width*r->height*job->pixel_bytes;
+    }
+    if (nworkers == 0 || bytes < PARALLEL_MIN_BYTES) {
+        struct job local = *job;
+        local.nbands = 1;
+        job_band(&local, 0);
+        return 0;
+    }
+
+    pool_wait();
+    pthread_mutex_lock(&pool_lock);
+    uint64_t generation = pool_job.generation + 1;
+    pool_job = *job;
+    pool_job.generation = generation;
+    pool_job.background = background;
+    /* In the foreground, this thread takes the last band */
+    pool_job.nbands = background ? nworkers : nworkers + 1;
+    pool_job.pending = nworkers;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+
+    if (background)
+        return 1;
+    job_band(&pool_job, nworkers);
+    pool_wait();
+    return 0;
+}
+
+/* Copies n bytes. With stream, non-temporal stores are used, so that the
+ * destination does not evict the source, or other useful data, from the
+ * cache: it is only read later, by the client. */
+static void copy_bytes(char* dst, const char* src, size_t n, int stream) {
+#ifdef __SSE2__
+    if (stream) {
+        size_t head = -(uintptr_t)dst & 15;
+        if (head > n)
+            head = n;
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        n -= head;
+        for (; n >= 64; n -= 64, dst += 64, src += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+            _mm_stream_si128((__m128i*)dst, a);
+            _mm_stream_si128((__m128i*)(dst + 16), b);
+            _mm_stream_si128((__m128i*)(dst + 32), c);
+            _mm_stream_si128((__m128i*)(dst + 48), d);
+        }
+    }
+#endif
+    memcpy(dst, src, n);
+}
+
+/* Job: copies rows y0 to y1 of r */
+static void copy_rows(const struct job* job, int band,
+                      const struct rect* r, int y0, int y1) {
+    size_t offset = (size_t)y0*job->stride + r->x*4;
+    int y;
+
+    if (r->width*4 == job->stride) {
+        copy_bytes(job->dst + offset, job->src + offset,
+                   (size_t)(y1 - y0)*job->stride, job->stream);
+    } else {
+        for (y = y0; y < y1; y++) {
+            copy_bytes(job->dst + offset, job->src + offset, r->width*4,
+                       job->stream);
+            offset += job->stride;
+        }
+    }
+#ifdef __SSE2__
+    /* Make the non-temporal stores visible before completion is signalled */
+    if (job->stream)
+        _mm_sfence();
+#endif
+}
+
+/* Copies the rectangles in region from src to dst, which both have rows of
+ * 32-bit pixels, stride bytes apart. In the background, returns 1 if the copy
+ * is still running (see pool_run). */
+static int copy_region(char* dst, const char* src, int stride,
+                       const struct region* reg, int background) {
+    struct job job = {
+        .rows = copy_rows, .region = *reg, .pixel_bytes = 4,
+        .dst = dst, .src = src, .stride = stride,
+    };
+    int i;
+    size_t bytes = 0;
+    for (i = 0; i < reg->nrects; i++)
+        bytes += (size_t)reg->rects[i].width*reg->rects[i].height*4;
+    job.stream = bytes >= PARALLEL_MIN_BYTES;
+    return pool_run(&job, background);
+}
+
+/* Output conversion: pixels of img are loaded as 0x00RRGGBB, downscaled,
+ * then stored in the output format, one row at a time. */
+
+/* Returns 1 if the client can take img as is */
+static int native_output() {
+    return out_format == FORMAT_BGRX && out_scale == 1 &&
+           img_format.pixels == PIXELS_BGRX &&
+           img->bytes_per_line == img->width*4;
+}
+
+/* Job: converts rows y0 to y1 of r (client coordinates) from img into conv */
+static void convert_rows(const struct job* job, int band,
+                         const struct rect* r, int y0, int y1) {
+    int bpp = img->bits_per_pixel / 8;
+    uint32_t* row0 = conv_rows + band*3*img->width;
+    uint32_t* row1 = row0 + img->width;
+    uint32_t* scaled = row1 + img->width;
+    int y;
+
+    for (y = y0; y < y1; y++) {
+        const char* src = img->data + y*out_scale*img->bytes_per_line +
+                          r->x*out_scale*bpp;
+        const uint32_t* px = load_pixels(row0, src, r->width*out_scale,
+                                         &img_format);
+        if (out_scale == 2) {
+            const uint32_t* px1 = load_pixels(
+                    row1, src + img->bytes_per_line, r->width*2, &img_format);
+            downscale_pixels(scaled, px, px1, r->width);
+            px = scaled;
+        }
+        store_pixels(conv + (y*conv_width + r->x)*4, px, r->width,
+                     out_format);
+    }
+}
+
+/* Converts the rectangles in reg (client coordinates) from img into conv */
+static void convert_region(const struct region* reg) {
+    struct job job = {
+        .rows = convert_rows, .region = *reg,
+        .pixel_bytes = 4*out_scale*out_scale,
+    };
+    pool_run(&job, 0);
+}
+
+/* Brings the output image up to date (width x height: the client buffer
+ * size), and returns it: img if the client can take it as is, conv
+ * otherwise. */
+static const char* update_output(int width, int height) {
+    uint64_t t = now_ns();
+
+    if (img_dirty.nrects > 0) {
+        capture_region(img, &img_dirty);
+        img_dirty.nrects = 0;
+        t = stats_add(STATS_CAPTURE, t);
+    }
+    if (native_output())
+        return img->data;
+
+    if (!conv || conv_width != width || conv_height != height) {
+        free(conv);
+        conv = malloc((size_t)width*height*4);
+        trueorabort(conv, "malloc");
+        conv_width = width;
+        conv_height = height;
+        region_full(&conv_dirty, width, height);
+    }
+    if (conv_dirty.nrects > 0) {
+        convert_region(&conv_dirty);
+        conv_dirty.nrects = 0;
+        stats_add(STATS_CONVERT, t);
+    }
+    return conv;
+}
+
+/* Sets dst to the rectangles of src (screen coordinates), scaled down to
+ * client coordinates (width x height), rounding outwards. */
+static void scale_region(struct region* dst, const struct region* src,
+                         int width, int height) {
+    int i;
+    dst->nrects = 0;
+    for (i = 0; i < src->nrects; i++) {
+        const struct rect* r = &src->rects[i];
+        int x0 = r->x / out_scale, y0 = r->y / out_scale;
+        int x1 = (r->x + r->width + out_scale - 1) / out_scale;
+        int y1 = (r->y + r->height + out_scale - 1) / out_scale;
+        region_add(dst, x0, y0, x1 - x0, y1 - y0, width, height);
+    }
+}
+
+/* Updates an exponentially weighted moving average */
+static void ewma(double* avg, double value) {
+    *avg = *avg > 0 ? 0.8*(*avg) + 0.2*value : value;
+}
+
+/* Picks the level for the next streamed frame */
+static int stream_level() {
+    int level, best = STREAM_RAW;
+    double best_ns = 0;
+
+    if (stream.socket_bpns == 0)
+        return STREAM_QOI;
+    for (level = STREAM_RAW; level < STREAM_LEVELS; level++) {
+        double ns = 1/stream.socket_bpns;  /* Per raw byte */
+        if (level != STREAM_RAW) {
+            if (stream.levels[level].encode_bpns == 0 ||
+                    stream.levels[level].idle >= STREAM_PROBE_FRAMES)
+                return level;
+            ns = 1/stream.levels[level].encode_bpns +
+                 stream.levels[level].ratio/stream.socket_bpns;
+        }
+        if (level == STREAM_RAW || ns < best_ns) {
+            best = level;
+            best_ns = ns;
+        }
+    }
+    return best;
+}
+
+/* Sends the rectangles in region, from image (rows of 32-bit pixels, stride
+ * bytes apart), as rect_data packets. */
+static void stream_region(const char* image, int stride,
+                          const struct region* reg) {
+    static const char* level_names[] = { "raw", "runs", "qoi" };
+    int level = stream_level();
+    uint64_t encode_ns = 0, send_ns = 0;
+    size_t raw = 0, sent = 0;
+    int i, y;
+
+    log(3, "Streaming %d rects (%s)", reg->nrects, level_names[level]);
+    for (i = 0; i < reg->nrects; i++) {
+        const struct rect* r = &reg->rects[i];
+        int rows = STREAM_BAND_PIXELS / r->width;
+
+        for (y = 0; y < r->height; y += rows) {
+            struct rect_data hdr = { .type = 'D', .codec = CODEC_RAW };
+            hdr.rect.x = r->x;
+            hdr.rect.y = r->y + y;
+            hdr.rect.width = r->width;
+            hdr.rect.height = r->height - y < rows ? r->height - y : rows;
+            const char* src = image + hdr.rect.y*stride + r->x*4;
+            size_t size = hdr.rect.width*hdr.rect.height*4;
+            struct iovec iov[2] = {
+                { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+                { .iov_base = stream_buffer, .iov_len = size },
+            };
+
+            uint64_t t = now_ns();
+            if (level != STREAM_RAW) {
+                iov[1].iov_len = qoi_encode(stream_buffer, src, hdr.rect.width,
+                                            hdr.rect.height, stride,
+                                            level == STREAM_RUNS);
+                /* Bands that do not compress are sent raw */
+                if (iov[1].iov_len < size)
+                    hdr.codec = CODEC_QOI;
+            }
+            if (hdr.codec == CODEC_RAW) {
+                iov[1].iov_len = size;
+                if (r->width*4 == stride) {
+                    /* Full rows: send straight from img */
+                    iov[1].iov_base = (void*)src;
+                } else {
+                    int j;
+                    for (j = 0; j < hdr.rect.height; j++) {
+                        memcpy(stream_buffer + j*r->width*4, src + j*stride,
+                               r->width*4);
+                    }
+                }
+            }
+            uint64_t t2 = now_ns();
+            encode_ns += t2 - t;
+
+            socket_client_writev_frame(iov, 2, WS_OPCODE_BINARY, 1, 1);
+            send_ns += now_ns() - t2;
+            raw += size;
+            sent += iov[1].iov_len;
+        }
+    }
+
+    for (i = STREAM_RAW; i < STREAM_LEVELS; i++)
+        stream.levels[i].idle++;
+    stream.levels[level].idle = 0;
+    if (level != STREAM_RAW) {
+        ewma(&stream.levels[level].encode_bpns,
+             (double)raw / (encode_ns + 1));
+        ewma(&stream.levels[level].ratio, (double)sent / raw);
+    }
+    if (sent >= STREAM_MIN_MEASURE)
+        ewma(&stream.socket_bpns, (double)sent / (send_ns + 1));
+}
+
+/* Job: hashes tile rows y0 to y1 (r covers all tiles, in tile units) */
+static void hash_rows(const struct job* job, int band,
+                      const struct rect* r, int y0, int y1) {
+    int stride = img->bytes_per_line;
+    int bpp = img->bits_per_pixel / 8;
+    int x, y;
+
+    for (y = y0; y < y1; y++) {
+        int top = y*TILE_SIZE;
+        int h = img->height - top < TILE_SIZE ? img->height - top : TILE_SIZE;
+        for (x = 0; x < r->width; x++) {
+            int left = x*TILE_SIZE;
+            int w = img->width - left < TILE_SIZE ?
+                        img->width - left : TILE_SIZE;
+            uint64_t hash = tile_hash(img->data + top*stride + left*bpp,
+                                      w*bpp, h, stride);
+            int i = y*r->width + x;
+            tile_changed[i] = hash != tile_hashes[i];
+            tile_hashes[i] = hash;
+        }
+    }
+}
+
+/* Captures the whole screen into img, and adds the tiles whose hash changed
+ * since the last call to damage. */
+static void hash_tiles(struct region* damage) {
+    int cols = (img->width + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (img->height + TILE_SIZE - 1) / TILE_SIZE;
+    int changed = 0;
+    int x, y;
+    uint64_t start = now_ns();
+
+    if (cols != tile_cols || rows != tile_rows) {
+        free(tile_hashes);
+        free(tile_changed);
+        tile_hashes = calloc(cols*rows, sizeof(*tile_hashes));
+        tile_changed = calloc(cols*rows, sizeof(*tile_changed));
+        trueorabort(tile_hashes && tile_changed, "calloc");
+        tile_cols = cols;
+        tile_rows = rows;
+        region_full(damage, img->width, img->height);
+    }
+
+    struct region full;
+    region_full(&full, img->width, img->height);
+    capture_region(img, &full);
+    img_dirty.nrects = 0;
+
+    struct job job = {
+        .rows = hash_rows,
+        .pixel_bytes = TILE_SIZE*TILE_SIZE*img->bits_per_pixel/8,
+    };
+    region_full(&job.region, cols, rows);
+    pool_run(&job, 0);
+
+    for (y = 0; y < rows; y++) {
+        for (x = 0; x < cols; x++) {
+            if (tile_changed[y*cols + x]) {
+                region_add(damage, x*TILE_SIZE, y*TILE_SIZE,
+                           TILE_SIZE, TILE_SIZE, img->width, img->height);
+                changed++;
+            }
+        }
+    }
+
+    log(3, "%d/%d tiles changed", changed, cols*rows);
+    stats_add(STATS_CAPTURE, start);
+}
+
+/* Drains the X event queue: damage and cursor changes are accumulated
+ * until the next frame is sent. */
+static void process_xevents() {
+    Window root = DefaultRootWindow(dpy);
+    XEvent ev;
+    uint64_t start = now_ns();
+    int nevents = 0;
+
+    while (XPending(dpy)) {
+        XNextEvent(dpy, &ev);
+        nevents++;
+        if (ev.type == MapNotify) {
+            /* Register damage on new windows */
+            register_damage(dpy, ev.xmap.window);
+            region_full(&pending_damage, UINT16_MAX, UINT16_MAX);
+        } else if (ev.type == ConfigureNotify &&
+                   ev.xconfigure.window == root) {
+            /* Resolution change */
+            region_full(&pending_damage, UINT16_MAX, UINT16_MAX);
+        } else if (ev.type == damageEvent + XDamageNotify) {
+            XDamageNotifyEvent* dev = (XDamageNotifyEvent*)&ev;
+            /* area is relative to the damaged window */
+            region_add(&pending_damage, dev->geometry.x + dev->area.x,
+                       dev->geometry.y + dev->area.y,
+                       dev->area.width, dev->area.height,
+                       UINT16_MAX, UINT16_MAX);
+        } else if (ev.type == fixesEvent + XFixesCursorNotify) {
+            XFixesCursorNotifyEvent* curev = (XFixesCursorNotifyEvent*)&ev;
+            if (verbose >= 2) {
+                char* name = XGetAtomName(dpy, curev->cursor_name);
+                log(2, "cursor! %ld %s", curev->cursor_serial, name);
+                XFree(name);
+            }
+            cursor_updated = 1;
+            cursor_serial = curev->cursor_serial;
+        }
+        /* Other events (unmap, configure...) show up as damage */
+    }
+
+    if (nevents > 0)
+        stats_add(STATS_EVENTS, start);
+}
+
+/* Sends reply, followed by its rectangles, from update */
+static void write_reply(const struct screen_reply* reply,
+                        const struct region* update) {
+    struct iovec iov[2] = {
+        { .iov_base = (void*)reply, .iov_len = sizeof(*reply) },
+        { .iov_base = (void*)update->rects,
+          .iov_len = reply->nrects*sizeof(struct rect) },
+    };
+    socket_client_writev_frame(iov, 2, WS_OPCODE_BINARY, 1, 0);
+}
+
+/* Completes the frame being copied in the background, if any: waits for the
+ * copy, then confirms the frame to the client (if still connected). */
+static void finish_frame() {
+    uint64_t events;
+    if (!inflight.active)
+        return;
+
+    pool_wait();
+    if (read(pool_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+        syserror("Cannot read completion.");
+    inflight.active = 0;
+
+    if (inflight.entry->sync)
+        msync(inflight.entry->map, inflight.size, MS_SYNC);
+    uint64_t t = stats_add(STATS_COPY, inflight.copy_start);
+    if (client_fd < 0)
+        return;
+    write_reply(&inflight.reply, &inflight.update);
+    stats_add(STATS_REPLY, t);
+    stats_add(STATS_FRAME, inflight.start);
+}
+
+/* Writes framebuffer image to websocket/shm */
+int write_image(const struct screen* screen) {
+    struct screen_reply replyhdr = { 0 };
+    struct screen_reply* reply = &replyhdr;
+    /* Areas that changed since the last frame, in screen coordinates, and
+     * in client coordinates (update) */
+    struct region damage = { 0 };
+    struct region update;
+    uint64_t start = now_ns();
+    /* Screen area sent to the client */
+    int width = screen->width*out_scale;
+    int height = screen->height*out_scale;
+
+    /* The previous frame must be complete before img changes */
+    finish_frame();
 
-    struct cache_entry* entry = find_shm(screen->paddr, screen->sig, size);
+    reply->type = 'S';
+    reply->width = screen->width;
+    reply->height = screen->height;
+    reply->buffer = screen->buffer;
+
+    if (alloc_image(width, height)) {
+        /* Force refresh */
+        region_full(&damage, width, height);
+    }
+
+    if (screen->refresh) {
+        log(1, "Force refresh from client.");
+        /* refresh forced by the client */
+        region_full(&damage, width, height);
+    }
+
+    /* Damage may not be reported: look for changes (unless poll_tiles just
+     * did) */
+    if (tile_hashing && !tiles_fresh)
+        hash_tiles(&damage);
+
+    /* Changes observed since the last frame */
+    region_union(&damage, &pending_damage, width, height);
+    pending_damage.nrects = 0;
+    reply->cursor_updated = cursor_updated;
+    reply->cursor_serial = cursor_serial;
+    cursor_updated = 0;
+
+    /* No update */
+    if (damage.nrects == 0) {
+        reply->shm = 0;
+        reply->updated = 0;
+        socket_client_write_frame((char*)reply, sizeof(*reply),
+                                  WS_OPCODE_BINARY, 1);
+        return 0;
+    }
+
+    /* Client buffer size, and row length */
+    int stride = screen->width*4;
+    int size = stride*screen->height;
+
+    /* All buffers we know of are now missing the new damage */
+    int i;
+    scale_region(&update, &damage, screen->width, screen->height);
+    region_union(&img_dirty, &damage, width, height);
+    region_union(&conv_dirty, &update, screen->width, screen->height);
+    for (i = 0; i < sizeof(cache)/sizeof(*cache); i++) {
+        region_union(&cache[i].dirty, &update, screen->width, screen->height);
+    }
+    for (i = 0; i < MAX_BUFFERS; i++) {
+        region_union(&ring[i].dirty, &update, screen->width, screen->height);
+    }
+    /* img was captured whole while hashing */
+    if (tile_hashing)
+        img_dirty.nrects = 0;
+
+    uint64_t t;
+    if (!screen->shm) {
+        /* Stream the changed areas, then confirm the frame */
+        const char* image = update_output(screen->width, screen->height);
+        t = now_ns();
+        stream_region(image, stride, &update);
+        t = stats_add(STATS_COPY, t);
+        reply->updated = 1;
+        reply->nrects = update.nrects;
+        write_reply(reply, &update);
+        stats_add(STATS_REPLY, t);
+        stats_add(STATS_FRAME, start);
+        return 0;
+    }
+
+    struct cache_entry* entry;
+    t = now_ns();
+    if (screen->ring) {
+        entry = NULL;
+        if (screen->buffer < MAX_BUFFERS && ring[screen->buffer].paddr) {
+            /* Maps the buffer again if the lookup failed on registration */
+            entry = map_shm(&ring[screen->buffer], ring[screen->buffer].paddr,
+                            screen->sig, size);
+        } else {
+            error("Buffer %d is not registered.", screen->buffer);
+        }
+    } else {
+        entry = find_shm(screen->paddr, screen->sig, size);
+    }
+    stats_add(STATS_FIND_SHM, t);
 
     reply->shm = 1;
     reply->updated = 1;
     reply->shmfailed = 0;
+    reply->nrects = update.nrects;
 
     if (entry && entry->map) {
         if (size == entry->length) {
-            memcpy(entry->map, img->data, size);
-            msync(entry->map, size, MS_SYNC);
+            if (entry->stale) {
+                region_full(&entry->dirty, screen->width, screen->height);
+                entry->stale = 0;
+            }
+            /* Overwrite the signature, which is not part of the damage */
+            region_add(&entry->dirty, 0, 0, sizeof(uint64_t)/4, 1,
+                       screen->width, screen->height);
+
+            if (entry->shminfo.shmseg && !tile_hashing && native_output()) {
+                /* Capture straight into the client buffer */
+                XImage dst = *img;
+                dst.data = entry->map;
+                dst.obdata = (char*)&entry->shminfo;
+                t = now_ns();
+                capture_region(&dst, &entry->dirty);
+                stats_add(STATS_CAPTURE, t);
+            } else {
+                /* Get damaged areas from framebuffer, then copy */
+                const char* image = update_output(screen->width,
+                                                  screen->height);
+                t = now_ns();
+                if (copy_region(entry->map, image, stride, &entry->dirty, 1)) {
+                    /* finish_frame replies once the copy is done */
+                    entry->dirty.nrects = 0;
+                    inflight.active = 1;
+                    inflight.reply = *reply;
+                    inflight.update = update;
+                    inflight.entry = entry;
+                    inflight.size = size;
+                    inflight.start = start;
+                    inflight.copy_start = t;
+                    return 0;
+                }
+                stats_add(STATS_COPY, t);
+            }
+            entry->dirty.nrects = 0;
+            if (entry->sync)
+                msync(entry->map, size, MS_SYNC);
         } else {
             /* This should never happen (it means the client passed an
              * outdated buffer to us). */
@@ -489,54 +2280,295 @@ int write_image(const struct screen* screen) {
     }
 
     /* Confirm write is done */
-    socket_client_write_frame(reply_raw, sizeof(*reply),
-                              WS_OPCODE_BINARY, 1);
+    t = now_ns();
+    write_reply(reply, &update);
+    stats_add(STATS_REPLY, t);
+    stats_add(STATS_FRAME, start);
 
     return 0;
 }
 
-/* Writes cursor image to websocket */
-int write_cursor() {
+/* Arms (or disarms, if ms is 0) the timer. */
+static void set_timer(int ms) {
+    struct itimerspec spec = { { 0 } };
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0)
+        syserror("Cannot set timer.");
+}
+
+/* Answers the oldest frame request that is held, if any. */
+static void release_screen() {
+    if (nheld == 0)
+        return;
+    struct screen screen = held_screens[0];
+    nheld--;
+    memmove(held_screens, held_screens+1, nheld*sizeof(*held_screens));
+    if (!subscribed)
+        set_timer(0);
+    write_image(&screen);
+}
+
+/* Forgets the requests held for a ring buffer, without answering them. */
+static void drop_screens(int buffer) {
+    int i, j = 0;
+    for (i = 0; i < nheld; i++) {
+        if (held_screens[i].buffer != buffer)
+            held_screens[j++] = held_screens[i];
+    }
+    nheld = j;
+}
+
+/* Sends a frame if something changed on screen, and a request is held.
+ * With a subscription, frames are rate-limited to subscribed_fps. */
+static void push_frames() {
+    if (nheld == 0 || (pending_damage.nrects == 0 && !cursor_updated))
+        return;
+
+    if (subscribed) {
+        if (subscribed_fps == 0)
+            return;
+        uint64_t now = now_ns();
+        uint64_t next = last_push + 1000000000ULL/subscribed_fps;
+        if (now < next) {
+            /* Round up, so that the timer does not fire too early */
+            set_timer((next - now + 999999) / 1000000);
+            return;
+        }
+        last_push = now;
+    }
+
+    release_screen();
+}
+
+/* Hash mode: returns how often the screen is polled for changes (ms) */
+static int poll_interval() {
+    if (subscribed && subscribed_fps > 0 &&
+            1000/subscribed_fps > HASH_POLL_MS)
+        return 1000/subscribed_fps;
+    return HASH_POLL_MS;
+}
+
+/* Hash mode: looks for changes on screen, and sends a frame if any. */
+static void poll_tiles() {
+    const struct screen* screen = &held_screens[0];
+    finish_frame();
+    if (alloc_image(screen->width*out_scale, screen->height*out_scale))
+        region_full(&pending_damage, UINT16_MAX, UINT16_MAX);
+    hash_tiles(&pending_damage);
+    /* Do not hash again if a frame is sent right away */
+    tiles_fresh = 1;
+    push_frames();
+    tiles_fresh = 0;
+}
+
+/* Handles timer expiration. Subscribed: the frame rate allows a new frame.
+ * Otherwise, nothing changed: answer the held request anyway, so that the
+ * client can detect a dead connection. In hash mode, the screen is polled
+ * until then. */
+static void timer_expired() {
+    if (tile_hashing && nheld > 0 && (!subscribed || subscribed_fps > 0)) {
+        poll_tiles();
+        if (nheld > 0 && (subscribed || now_ns() < held_until)) {
+            set_timer(poll_interval());
+            return;
+        }
+    }
+
+    if (subscribed)
+        push_frames();
+    else
+        release_screen();
+}
+
+/* Handles a frame request: it is answered right away if something changed
+ * since the last frame. Otherwise, it is held until damage or a cursor
+ * change is observed, so that the client does not need to poll. */
+static void request_screen(const struct screen* screen) {
+    if (screen->refresh || !img || img->width != screen->width*out_scale ||
+            img->height != screen->height*out_scale)
+        region_full(&pending_damage, UINT16_MAX, UINT16_MAX);
+
+    /* Only one request is held: a new one takes its place, and is answered
+     * by the same deadline (which input may have shortened). */
+    if (!subscribed && nheld > 0) {
+        log(3, "Updating held frame request (buffer %d).", screen->buffer);
+        held_screens[0] = *screen;
+        held_screens[0].refresh = 0;
+        push_frames();
+        return;
+    }
+
+    if (nheld == MAX_BUFFERS) {
+        error("Too many frame requests held.");
+        release_screen();
+    }
+
+    log(3, "Holding frame request (buffer %d).", screen->buffer);
+    held_screens[nheld] = *screen;
+    /* The refresh is now part of the pending damage */
+    held_screens[nheld].refresh = 0;
+    nheld++;
+
+    if (!subscribed) {
+        held_until = now_ns() + HOLD_TIMEOUT_MS*1000000ULL;
+        set_timer(tile_hashing ? poll_interval() : HOLD_TIMEOUT_MS);
+    } else if (tile_hashing && nheld == 1) {
+        set_timer(poll_interval());
+    }
+    push_frames();
+}
+
+/* Input came in: the held request, if any, is answered within INPUT_HOLD_MS.
+ * With a subscription, frames only wait for damage. */
+static void shorten_hold() {
+    uint64_t until = now_ns() + INPUT_HOLD_MS*1000000ULL;
+    if (subscribed || nheld == 0 || until >= held_until)
+        return;
+    held_until = until;
+    /* In hash mode, the next poll answers the request */
+    if (!tile_hashing)
+        set_timer(INPUT_HOLD_MS);
+}
+
+/* Subscribes to frames, or changes the frame rate. */
+static void subscribe(const struct subscribe* u) {
+    log(1, "Subscribed at %d fps.", u->fps);
+    if (!subscribed || u->fps == 0)
+        set_timer(0);
+    subscribed = 1;
+    subscribed_fps = u->fps;
+    if (tile_hashing && nheld > 0 && u->fps > 0)
+        set_timer(poll_interval());
+}
+
+/* Changes the output format. The next frame is a full update. */
+static void set_output(const struct output* o) {
+    if (o->format > FORMAT_RGBA || (o->scale != 1 && o->scale != 2)) {
+        error("Invalid output format %d, scale %d.", o->format, o->scale);
+        return;
+    }
+    log(1, "Output format %d, scale %d.", o->format, o->scale);
+    out_format = o->format;
+    out_scale = o->scale;
+    region_full(&pending_damage, UINT16_MAX, UINT16_MAX);
+    region_full(&conv_dirty, conv_width, conv_height);
+}
+
+/* Returns the cached image of the current cursor, fetching it from X if
+ * needed. Returns NULL on error. */
+static struct cursor_entry* get_cursor() {
+    struct cursor_entry* entry = NULL;
+    int i;
+
+    cursor_clock++;
+    for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+        if (cursor_serial && cursor_cache[i].serial == cursor_serial) {
+            cursor_cache[i].used = cursor_clock;
+            return &cursor_cache[i];
+        }
+        if (!entry || cursor_cache[i].used < entry->used)
+            entry = &cursor_cache[i];
+    }
+
     XFixesCursorImage *img = XFixesGetCursorImage(dpy);
     if (!img) {
         error("XFixesGetCursorImage returned NULL");
-        return -1;
+        return NULL;
     }
+
     int size = img->width*img->height;
-    const int replylength = sizeof(struct cursor_reply) + size*sizeof(uint32_t);
-    char reply_raw[FRAMEMAXHEADERSIZE + replylength];
-    struct cursor_reply* reply =
-        (struct cursor_reply*)(reply_raw + FRAMEMAXHEADERSIZE);
-
-    memset(reply_raw, 0, sizeof(*reply_raw));
-
-    reply->type = 'P';
-    reply->width = img->width;
-    reply->height = img->height;
-    reply->xhot = img->xhot;
-    reply->yhot = img->yhot;
-    reply->cursor_serial = img->cursor_serial;
-    /* This casts long[] to uint32_t[] */
+    uint32_t* pixels = realloc(entry->pixels, size*sizeof(uint32_t));
+    trueorabort(pixels || size == 0, "realloc");
+    narrow_pixels(pixels, img->pixels, size);
+
+    entry->serial = img->cursor_serial;
+    entry->width = img->width;
+    entry->height = img->height;
+    entry->xhot = img->xhot;
+    entry->yhot = img->yhot;
+    entry->pixels = pixels;
+    entry->hash = cursor_hash(entry->width, entry->height,
+                              entry->xhot, entry->yhot, pixels);
+    entry->used = cursor_clock;
+    XFree(img);
+
+    return entry;
+}
+
+/* Returns 1 if the client has the cursor with this hash, and records it
+ * otherwise (oldest hashes are forgotten first). */
+static int client_has_cursor(uint32_t hash) {
     int i;
-    for (i = 0; i < size; i++)
-        reply->pixels[i] = img->pixels[i];
+    for (i = 0; i < nclient_cursors; i++) {
+        if (client_cursors[i] == hash)
+            return 1;
+    }
+    if (nclient_cursors == MAX_CURSOR_HASHES) {
+        memmove(client_cursors, client_cursors + 1,
+                (MAX_CURSOR_HASHES - 1)*sizeof(*client_cursors));
+        nclient_cursors--;
+    }
+    client_cursors[nclient_cursors++] = hash;
+    return 0;
+}
 
-    socket_client_write_frame(reply_raw, replylength, WS_OPCODE_BINARY, 1);
-    XFree(img);
+/* Records the cursors the client already has */
+static void set_client_cursors(const struct cursor_hashes* h) {
+    client_cursor_hashes = 1;
+    nclient_cursors = h->count;
+    memcpy(client_cursors, h->hashes, h->count*sizeof(*client_cursors));
+    log(2, "Client has %d cursors.", nclient_cursors);
+}
+
+/* Writes cursor image to websocket, or only its hash if the client already
+ * has it */
+int write_cursor() {
+    struct cursor_entry* entry = get_cursor();
+    if (!entry)
+        return -1;
+
+    int known = client_has_cursor(entry->hash);
+    if (known && client_cursor_hashes) {
+        struct cursor_known known;
+        known.type = 'H';
+        known.cursor_serial = entry->serial;
+        known.hash = entry->hash;
+        log(2, "Cursor %u known (%08x).", entry->serial, entry->hash);
+        socket_client_write_frame((char*)&known, sizeof(known),
+                                  WS_OPCODE_BINARY, 1);
+        return 0;
+    }
+
+    struct cursor_reply reply;
+    struct iovec iov[2] = {
+        { .iov_base = &reply, .iov_len = sizeof(reply) },
+        { .iov_base = entry->pixels,
+          .iov_len = entry->width*entry->height*sizeof(uint32_t) },
+    };
+
+    reply.type = 'P';
+    reply.width = entry->width;
+    reply.height = entry->height;
+    reply.xhot = entry->xhot;
+    reply.yhot = entry->yhot;
+    reply.cursor_serial = entry->serial;
+
+    socket_client_writev_frame(iov, 2, WS_OPCODE_BINARY, 1, 0);
 
     return 0;
 }
 
 void write_init() {
-    char raw[FRAMEMAXHEADERSIZE + sizeof(struct initinfo)];
-    struct initinfo* i = (struct initinfo*)(raw + FRAMEMAXHEADERSIZE);
+    struct initinfo init;
+    struct initinfo* i = &init;
     i->type = 'I';
     i->freon = 0;
     if (access("/sys/class/tty/tty0/active", F_OK) == -1) {
         trueorabort(errno == ENOENT, "Could not determine if using Freon or not");
         i->freon = 1;
     }
-    socket_client_write_frame(raw, sizeof(*i), WS_OPCODE_BINARY, 1);
+    socket_client_write_frame((char*)i, sizeof(*i), WS_OPCODE_BINARY, 1);
 }
 
 /* Checks if a packet size is correct */
@@ -549,19 +2581,166 @@ int check_size(int length, int target, char* error) {
     return 1;
 }
 
+/* Reads and handles one packet from the client */
+void handle_client(unsigned char* buffer, int size) {
+    int length = socket_client_read_frame((char*)buffer, size);
+    if (length < 0) {
+        socket_client_close(1);
+        return;
+    }
+
+    if (length < 1) {
+        error("Invalid packet from client (size <1).");
+        socket_client_close(0);
+        return;
+    }
+
+    /* Input is only queued for the input thread, and goes through while a
+     * frame is being copied: anything else may need the copy to be
+     * complete, and may take a while, so queued input is sent first. */
+    if (!strchr("KCMEQ", buffer[0]) || buffer[0] == '\0') {
+        flush_input();
+        finish_frame();
+    } else {
+        shorten_hold();
+    }
+
+    switch (buffer[0]) {
+    case 'S':  /* Screen */
+        if (!check_size(length, sizeof(struct screen), "screen"))
+            break;
+        request_screen((struct screen*)buffer);
+        break;
+    case 'B':  /* Buffer registration */
+        if (!check_size(length, sizeof(struct buffer), "buffer"))
+            break;
+        /* The client is reallocating its buffers: do not hold on to a
+         * request for an old one. A subscribed client does not expect a
+         * reply for buffers it registers again. */
+        if (subscribed)
+            drop_screens(((struct buffer*)buffer)->index);
+        else
+            release_screen();
+        register_buffer((struct buffer*)buffer);
+        break;
+    case 'U':  /* Subscription */
+        if (!check_size(length, sizeof(struct subscribe), "subscribe"))
+            break;
+        subscribe((struct subscribe*)buffer);
+        break;
+    case 'O':  /* Output format */
+        if (!check_size(length, sizeof(struct output), "output"))
+            break;
+        set_output((struct output*)buffer);
+        break;
+    case 'P':  /* Cursor */
+        if (!check_size(length, sizeof(struct cursor), "cursor"))
+            break;
+        write_cursor();
+        break;
+    case 'H': {  /* Cursors known to the client */
+        struct cursor_hashes* h = (struct cursor_hashes*)buffer;
+        if (length < sizeof(*h) || h->count > MAX_CURSOR_HASHES ||
+            !check_size(length, sizeof(*h) + h->count*sizeof(uint32_t),
+                        "cursor_hashes"))
+            break;
+        set_client_cursors(h);
+        break;
+    }
+    case 'R':  /* Resolution */
+        if (!check_size(length, sizeof(struct resolution),
+                        "resolution"))
+            break;
+        request_resolution((struct resolution*)buffer);
+        break;
+    case 'K': {  /* Key */
+        if (!check_size(length, sizeof(struct key), "key"))
+            break;
+        struct key* k = (struct key*)buffer;
+        queue_input('K', k->keycode, k->down, 0, 0);
+        break;
+    }
+    case 'C': {  /* Click */
+        if (!check_size(length, sizeof(struct mouseclick),
+                        "mouseclick"))
+            break;
+        struct mouseclick* mc = (struct mouseclick*)buffer;
+        queue_input('C', mc->button, mc->down, 0, 0);
+        break;
+    }
+    case 'M': {  /* Mouse move */
+        if (!check_size(length, sizeof(struct mousemove), "mousemove"))
+            break;
+        struct mousemove* mm = (struct mousemove*)buffer;
+        queue_input('M', 0, 0, mm->x*out_scale, mm->y*out_scale);
+        break;
+    }
+    case 'E': {  /* Batch of input events */
+        struct input* in = (struct input*)buffer;
+        if (length < sizeof(*in) || in->count > MAX_INPUT_EVENTS ||
+            !check_size(length,
+                        sizeof(*in) + in->count*sizeof(struct input_event),
+                        "input"))
+            break;
+        replay_input(in);
+        break;
+    }
+    case 'T':  /* Timing statistics */
+        if (!check_size(length, sizeof(struct stats), "stats"))
+            break;
+        write_stats((struct stats*)buffer);
+        break;
+    case 'Q':  /* "Quit": release all keys */
+        send_input('Q', 0, 0, 0, 0);
+        break;
+    default:
+        error("Invalid packet from client (%d).", buffer[0]);
+        socket_client_close(0);
+    }
+}
+
+/* Handles all the packets the client sent so far, then sends the input
+ * events they contain to the input thread, in one go. */
+static void read_client(unsigned char* buffer, int size) {
+    do {
+        handle_client(buffer, size);
+    } while (client_fd >= 0 && socket_client_pending());
+    flush_input();
+}
+
+/* Adds fd to the main loop */
+static void epoll_add(int fd) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    trueorabort(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0, "epoll_ctl");
+}
+
 /* Prints usage */
 void usage(char* argv0) {
-    fprintf(stderr, "%s [-v 0-3] display\n", argv0);
+    fprintf(stderr, "%s [-v 0-3] [-s findnacld socket] [-H] [-j threads] "
+                    "display\n"
+                    "  -H  hash tiles to find changes, for applications that\n"
+                    "      do not report damage\n"
+                    "  -j  worker threads (default: number of CPUs, minus "
+                    "one)\n", argv0);
     exit(1);
 }
 
 int main(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "v:")) != -1) {
+    while ((c = getopt(argc, argv, "v:s:Hj:")) != -1) {
         switch (c) {
         case 'v':
             verbose = atoi(optarg);
             break;
+        case 's':
+            findnacl_path = optarg;
+            break;
+        case 'H':
+            tile_hashing = 1;
+            break;
+        case 'j':
+            nworkers = atoi(optarg);
+            break;
         default:
             usage(argv[0]);
         }
@@ -579,92 +2758,119 @@ int main(int argc, char** argv) {
     trueorabort(display+1 != endptr && (*endptr == '\0' || *endptr == '.'),
                 "Invalid display number: '%s'", display);
 
+    /* The main, input and resize threads each have their own connection,
+     * but Xlib also has process-wide state. */
+    XInitThreads();
     init_display(display);
     socket_server_init(PORT_BASE + displaynum);
 
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    trueorabort(epfd >= 0, "epoll_create1");
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+    trueorabort(timer_fd >= 0, "timerfd_create");
+    epoll_add(ConnectionNumber(dpy));
+    epoll_add(timer_fd);
+
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGUSR1);
+    trueorabort(sigprocmask(SIG_BLOCK, &sigmask, NULL) == 0, "sigprocmask");
+    signal_fd = signalfd(-1, &sigmask, SFD_CLOEXEC|SFD_NONBLOCK);
+    trueorabort(signal_fd >= 0, "signalfd");
+    epoll_add(signal_fd);
+
+    /* Worker, input and resize threads inherit the blocked signals */
+    pool_init();
+    input_init(display);
+    resize_init(display);
+    epoll_add(pool_fd);
+    epoll_add(resize_fd);
+    epoll_add(input_room_fd);
+
     unsigned char buffer[BUFFERSIZE];
-    int length;
+    struct epoll_event events[MAX_EVENTS];
 
     while (1) {
         set_connected(dpy, False);
         socket_server_accept(VERSION);
         write_init();
         set_connected(dpy, True);
-        while (1) {
-            length = socket_client_read_frame((char*)buffer, sizeof(buffer));
-            if (length < 0) {
-                socket_client_close(1);
-                break;
-            }
-
-            if (length < 1) {
-                error("Invalid packet from client (size <1).");
-                socket_client_close(0);
-                break;
+        if (client_fd >= 0)
+            epoll_add(client_fd);
+        while (client_fd >= 0) {
+            /* Xlib may have queued events while waiting for replies, so the
+             * queue is drained before waiting on the connection. */
+            process_xevents();
+            push_frames();
+
+            /* Frames that were already read from the socket do not show up
+             * in epoll: do not wait if there are any. */
+            int pending = socket_client_pending();
+            int i, n = epoll_wait(epfd, events, MAX_EVENTS, pending ? 0 : -1);
+            if (n < 0) {
+                trueorabort(errno == EINTR, "epoll_wait");
+                continue;
             }
 
-            switch (buffer[0]) {
-            case 'S':  /* Screen */
-                if (!check_size(length, sizeof(struct screen), "screen"))
-                    break;
-                write_image((struct screen*)buffer);
-                break;
-            case 'P':  /* Cursor */
-                if (!check_size(length, sizeof(struct cursor), "cursor"))
-                    break;
-                write_cursor();
-                break;
-            case 'R':  /* Resolution */
-                if (!check_size(length, sizeof(struct resolution),
-                                "resolution"))
-                    break;
-                change_resolution((struct resolution*)buffer);
-                break;
-            case 'K': {  /* Key */
-                if (!check_size(length, sizeof(struct key), "key"))
-                    break;
-                struct key* k = (struct key*)buffer;
-                log(2, "Key: kc=%04x\n", k->keycode);
-                XTestFakeKeyEvent(dpy, k->keycode, k->down, CurrentTime);
-                if (k->down) {
-                    kb_add(KEYBOARD, k->keycode);
-                } else {
-                    kb_remove(KEYBOARD, k->keycode);
+            for (i = 0; i < n && client_fd >= 0; i++) {
+                int fd = events[i].data.fd;
+                if (fd == client_fd) {
+                    read_client(buffer, sizeof(buffer));
+                    pending = 0;
+                } else if (fd == timer_fd) {
+                    uint64_t expirations;
+                    if (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+                        timer_expired();
+                } else if (fd == pool_fd) {
+                    finish_frame();
+                } else if (fd == resize_fd) {
+                    finish_resolution();
+                } else if (fd == input_room_fd) {
+                    uint64_t count;
+                    if (read(input_room_fd, &count, sizeof(count)) > 0) {
+                        queue_pending_motion();
+                        flush_input();
+                    }
+                } else if (fd == findnacl_fd) {
+                    /* Lookups may remap the buffer being copied to */
+                    finish_frame();
+                    findnacl_recv();
+                    complete_lookups();
+                } else if (fd == signal_fd) {
+                    struct signalfd_siginfo info;
+                    if (read(signal_fd, &info, sizeof(info)) > 0)
+                        stats_dump();
                 }
-                break;
-            }
-            case 'C': {  /* Click */
-                if (!check_size(length, sizeof(struct mouseclick),
-                                "mouseclick"))
-                    break;
-                struct mouseclick* mc = (struct mouseclick*)buffer;
-                XTestFakeButtonEvent(dpy, mc->button, mc->down, CurrentTime);
-                if (mc->down) {
-                    kb_add(MOUSE, mc->button);
-                } else {
-                    kb_remove(MOUSE, mc->button);
-                }
-                break;
-            }
-            case 'M': {  /* Mouse move */
-                if (!check_size(length, sizeof(struct mousemove), "mousemove"))
-                    break;
-                struct mousemove* mm = (struct mousemove*)buffer;
-                XTestFakeMotionEvent(dpy, 0, mm->x, mm->y, CurrentTime);
-                break;
-            }
-            case 'Q':  /* "Quit": release all keys */
-                kb_release_all();
-                break;
-            default:
-                error("Invalid packet from client (%d).", buffer[0]);
-                socket_client_close(0);
+                /* X events are processed at the top of the loop */
             }
+
+            if (pending && client_fd >= 0)
+                read_client(buffer, sizeof(buffer));
         }
+        finish_frame();
         socket_client_close(0);
-        kb_release_all();
-        close_mmap(&cache[0]);
-        close_mmap(&cache[1]);
+        send_input('Q', 0, 0, 0, 0);
+        resize_discard = resize.serial;
+        nheld = 0;
+        subscribed = 0;
+        nclient_cursors = 0;
+        client_cursor_hashes = 0;
+        out_format = FORMAT_BGRX;
+        out_scale = 1;
+        set_timer(0);
+        log(1, "shm cache: %lu hits, %lu misses, %lu evictions",
+            cache_stats.hits, cache_stats.misses, cache_stats.evictions);
+        if (verbose >= 1)
+            stats_dump();
+        int i;
+        for (i = 0; i < CACHE_SIZE; i++) {
+            close_mmap(&cache[i]);
+            cache[i].paddr = 0;
+        }
+        for (i = 0; i < MAX_BUFFERS; i++) {
+            close_mmap(&ring[i]);
+            ring[i].paddr = 0;
+        }
     }
 
     return 0;
@@ -0,0 +1,38 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Protocol between croutonfindnacld and its clients (croutonfbserver).
+ *
+ * Clients keep a SOCK_SEQPACKET connection open to FINDNACL_SOCKET_PATH, and
+ * send one findnacl_request per packet. Several requests may be in flight:
+ * the daemon answers each of them, in any order, with a findnacl_reply
+ * carrying the same id, with the shm file descriptor attached (SCM_RIGHTS) on
+ * success.
+ */
+
+#ifndef FINDNACLD_PROTO_H_
+#define FINDNACLD_PROTO_H_
+
+#include <stdint.h>
+
+#define FINDNACL_SOCKET_DIR "/var/run/crouton-ext"
+#define FINDNACL_SOCKET_PATH FINDNACL_SOCKET_DIR "/socket"
+
+/* Looks for the shm at NaCl address paddr, starting with signature sig */
+struct  __attribute__((__packed__)) findnacl_request {
+    char type;  /* 'F' */
+    uint8_t pad[3];
+    uint32_t id;
+    uint64_t paddr;
+    uint64_t sig;
+};
+
+struct  __attribute__((__packed__)) findnacl_reply {
+    char type;  /* 'F' */
+    uint8_t pad[3];
+    uint32_t id;
+    int32_t pid;  /* nacl_helper process owning the shm, -1 on error */
+};
+
+#endif /* FINDNACLD_PROTO_H_ */
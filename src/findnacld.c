@@ -3,6 +3,7 @@
  * found in the LICENSE file.
  */
 #include "websocket.h"
+#include "findnacld-proto.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,26 +12,39 @@
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 
 #define MAX_EVENTS 100
+/* Number of (pid, address) pairs remembered across lookups */
+#define INDEX_SIZE 32
+/* Length of the buffer signature, in bytes */
+#define SIG_LEN 8
+/* Number of threads running lookups, so that a slow /proc scan for one
+ * fbserver does not hold back the others */
+#define LOOKUP_THREADS 4
+/* Time a reply waits for room in the socket of a client that is slow to
+ * read, before the client is dropped */
+#define REPLY_TIMEOUT_MS 5000
 
-const char *SOCKET_DIR = "/var/run/crouton-ext";
-const char *SOCKET_PATH = "/var/run/crouton-ext/socket";
-
-int send_pid_fd(int conn, long pid, int fd)
+/* Sends the reply to request id, passing fd if it is valid. */
+int send_reply(int conn, uint32_t id, long pid, int fd)
 {
     struct msghdr msg = {0};
     struct cmsghdr *cmsg;
     struct iovec iov;
+    struct findnacl_reply reply = {0};
     char buf[CMSG_SPACE(sizeof(int))]; /* ancillary data buffer */
 
-    /* It is not necessary to sent the pid. However, to pass fd using sendmsg,
-     * at least 1 byte of data must be sent.
-     */
-    iov.iov_base = &pid;
-    iov.iov_len = sizeof(pid);
+    reply.type = 'F';
+    reply.id = id;
+    reply.pid = pid;
+
+    iov.iov_base = &reply;
+    iov.iov_len = sizeof(reply);
 
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
@@ -49,77 +63,386 @@ int send_pid_fd(int conn, long pid, int fd)
         msg.msg_controllen = 0;
     }
 
-    return sendmsg(conn, &msg, 0);
+    /* The socket may be full if the client is slow to read its replies:
+     * wait for room, but not forever, so that a client that stopped reading
+     * does not hold a lookup thread. */
+    int ret;
+    while ((ret = sendmsg(conn, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        struct pollfd pfd = { .fd = conn, .events = POLLOUT };
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return ret;
 }
 
+/* Index of shm files found in previous lookups: (pid, address) -> fd number
+ * in the nacl_helper process. Entries are checked before scanning /proc, and
+ * dropped when they do not lead to a matching file anymore. */
+struct shm_index {
+    long pid;
+    uint32_t addr;
+    int fd;
+};
 
-int find_nacl(int conn)
-{
-    char argbuf[70], outbuf[256];
-    char* cut;
-    int c;
+static struct shm_index shm_index[INDEX_SIZE];
+static int next_index;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Request waiting for a lookup thread. conn is a duplicate of the connection
+ * fd, owned by the job: the main loop may close the connection, and reuse its
+ * fd number, while the lookup runs. */
+struct job {
+    struct job* next;
+    int conn;
+    struct findnacl_request req;
+};
+
+static struct job* jobs;
+static struct job** jobs_tail = &jobs;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/* Opens /proc/pid/fd/fd and checks that its first 8 bytes match sig.
+ * Returns a file descriptor on success, -1 on error. */
+static int open_check_sig(long pid, int fd, const uint8_t* sig) {
+    char path[64];
+    uint8_t buf[SIG_LEN];
+
+    snprintf(path, sizeof(path), "/proc/%ld/fd/%d", pid, fd);
+    int file = open(path, O_RDWR);
+    if (file < 0)
+        return -1;
+
+    if (pread(file, buf, SIG_LEN, 0) != SIG_LEN ||
+            memcmp(buf, sig, SIG_LEN)) {
+        close(file);
+        return -1;
+    }
+
+    log(2, "Match %s", path);
+    return file;
+}
+
+/* Returns 1 if file descriptors a and b point to the same file. */
+static int same_file(int a, int b) {
+    struct stat sa, sb;
+    return fstat(a, &sa) == 0 && fstat(b, &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* Call with index_lock held. */
+static void index_add(long pid, uint32_t addr, int fd) {
+    struct shm_index* entry = &shm_index[next_index];
+    next_index = (next_index + 1) % INDEX_SIZE;
+    entry->pid = pid;
+    entry->addr = addr;
+    entry->fd = fd;
+}
+
+/* Forgets the entries matching old, unless another thread replaced them. */
+static void index_drop(const struct shm_index* old) {
+    int i;
+    pthread_mutex_lock(&index_lock);
+    for (i = 0; i < INDEX_SIZE; i++) {
+        struct shm_index* entry = &shm_index[i];
+        if (entry->pid == old->pid && entry->addr == old->addr &&
+                entry->fd == old->fd)
+            entry->pid = 0;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+/* Returns 1 if /proc/pid/comm is nacl_helper. */
+static int is_nacl_helper(long pid) {
+    char path[64], comm[32];
+
+    snprintf(path, sizeof(path), "/proc/%ld/comm", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    int c = read(fd, comm, sizeof(comm)-1);
+    close(fd);
+    if (c <= 0)
+        return 0;
+    comm[c] = 0;
+    return strstr(comm, "nacl_helper") != NULL;
+}
+
+/* Finds the shm file mapped at addr (modulo a prefix in the MSBs) in the
+ * maps of pid, and stores its path in file.
+ * Returns 0 on success, -1 if no such mapping exists. */
+static int find_mapping(long pid, uint32_t addr, char* file, size_t size) {
+    char path[64];
+    char line[PATH_MAX + 128];
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "/proc/%ld/maps", pid);
+    FILE* maps = fopen(path, "r");
+    if (!maps)
+        return -1;
+
+    while (fgets(line, sizeof(line), maps)) {
+        /* start-end perms offset dev inode path */
+        char* endptr;
+        unsigned long start = strtoul(line, &endptr, 16);
+        if (*endptr != '-' || (uint32_t)start != addr)
+            continue;
+
+        char perms[8], name[PATH_MAX];
+        if (sscanf(endptr, "-%*x %7s %*x %*s %*u %4095s", perms, name) != 2)
+            continue;
+        if (strcmp(perms, "rw-s") ||
+                (!strstr(name, "/shm/.com.google.Chrome") &&
+                 !strstr(name, "/shm/.org.chromium.Chromium")))
+            continue;
+
+        log(2, "pid %ld: mapping %s", pid, name);
+        strncpy(file, name, size-1);
+        file[size-1] = 0;
+        ret = 0;
+        break;
+    }
+
+    fclose(maps);
+    return ret;
+}
+
+/* Scans the file descriptors of pid for one that points to file, with the
+ * right signature. Returns an opened file descriptor on success, -1 on
+ * error, and fills in the fd number within pid. */
+static int find_fd(long pid, const char* file, const uint8_t* sig,
+                   int* pidfd) {
+    char path[64], link[PATH_MAX];
+    const char* deleted = " (deleted)";
+    int file_fd = -1;
+
+    snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+    DIR* dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+        char* endptr;
+        long fd = strtol(ent->d_name, &endptr, 10);
+        if (ent->d_name == endptr || *endptr != '\0')
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%ld/fd/%ld", pid, fd);
+        ssize_t len = readlink(path, link, sizeof(link)-1);
+        if (len < 0)
+            continue;
+        link[len] = 0;
+        size_t dlen = strlen(deleted);
+        if (len >= dlen && !strcmp(link + len - dlen, deleted))
+            link[len - dlen] = 0;
+        if (strcmp(link, file))
+            continue;
+
+        int match = open_check_sig(pid, fd, sig);
+        if (match < 0)
+            continue;
+        /* Second match? Only fine if this is the same file, opened twice */
+        if (file_fd >= 0) {
+            if (same_file(file_fd, match)) {
+                close(match);
+                continue;
+            }
+            error("Ambiguous match for %s.", file);
+            close(match);
+            close(file_fd);
+            file_fd = -1;
+            break;
+        }
+        file_fd = match;
+        *pidfd = fd;
+    }
+
+    closedir(dir);
+    return file_fd;
+}
+
+/* Finds the shm file at NaCl address addr with signature sig in any of the
+ * nacl_helper processes. All of them are checked: if two processes (e.g. two
+ * Chrome profiles) have different matching files, the lookup fails rather
+ * than return the wrong buffer. Returns an opened file descriptor, and sets
+ * pid, on success. Returns -1 on error. */
+static int find_shm_file(uint32_t addr, const uint8_t* sig, long* pid) {
+    struct shm_index seen[INDEX_SIZE];
+    int nseen = 0;
+    int i, fd;
 
-    if ((c = read(conn, argbuf, sizeof(argbuf)-1)) < 0) {
-       syserror("Failed to read arguments");
-       return -1;
+    /* Fast path: buffer already seen. The entries are copied, so that other
+     * lookups can use the index while these are checked in /proc. */
+    pthread_mutex_lock(&index_lock);
+    for (i = 0; i < INDEX_SIZE; i++) {
+        if (shm_index[i].pid > 0 && shm_index[i].addr == addr)
+            seen[nseen++] = shm_index[i];
     }
-    argbuf[c] = 0;
+    pthread_mutex_unlock(&index_lock);
 
-    cut = strchr(argbuf, ' ');
-    if (!cut) {
-        error("No ' ' in findnacl arguments: %s.", argbuf);
+    for (i = 0; i < nseen; i++) {
+        if ((fd = open_check_sig(seen[i].pid, seen[i].fd, sig)) >= 0) {
+            *pid = seen[i].pid;
+            return fd;
+        }
+        /* The buffer was freed, or reallocated at the same address */
+        index_drop(&seen[i]);
+    }
+
+    DIR* proc = opendir("/proc");
+    if (!proc) {
+        syserror("Cannot open /proc.");
         return -1;
     }
-    *cut = 0;
 
-    char *cmd = "croutonfindnacl";
-    char* args[] = {cmd, argbuf, cut + 1, NULL};
+    fd = -1;
+    int pidfd = -1;
+    struct dirent* ent;
+    while ((ent = readdir(proc))) {
+        char* endptr;
+        long p = strtol(ent->d_name, &endptr, 10);
+        if (ent->d_name == endptr || *endptr != '\0')
+            continue;
+        if (!is_nacl_helper(p))
+            continue;
 
-    c = popen2(cmd, args, NULL, 0, outbuf, sizeof(outbuf)-1);
-    if (c <= 0) {
-        error("Error running helper");
+        char file[PATH_MAX];
+        if (find_mapping(p, addr, file, sizeof(file)) < 0)
+            continue;
+
+        int match_pidfd;
+        int match = find_fd(p, file, sig, &match_pidfd);
+        if (match < 0)
+            continue;
+        if (fd >= 0) {
+            if (same_file(fd, match)) {
+                close(match);
+                continue;
+            }
+            error("Ambiguous match for %08x (pids %ld and %ld).",
+                  addr, *pid, p);
+            close(match);
+            close(fd);
+            fd = -1;
+            break;
+        }
+        fd = match;
+        *pid = p;
+        pidfd = match_pidfd;
+    }
+
+    closedir(proc);
+    if (fd >= 0) {
+        pthread_mutex_lock(&index_lock);
+        index_add(*pid, addr, pidfd);
+        pthread_mutex_unlock(&index_lock);
+    }
+    return fd;
+}
+
+/* Reads one request from conn, and queues it for a lookup thread. Returns -1
+ * if the connection should be closed. */
+int read_request(int conn)
+{
+    struct findnacl_request req;
+    int c;
+
+    if ((c = recv(conn, &req, sizeof(req), MSG_DONTWAIT)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        syserror("Failed to read request");
         return -1;
     }
-    outbuf[c] = 0;
 
-    /* Parse PID:file output */
-    cut = strchr(outbuf, ':');
-    if (!cut) {
-        error("No ':' in helper reply: %s.", outbuf);
+    /* Connection closed */
+    if (c == 0)
+        return -1;
+
+    if (c != sizeof(req) || req.type != 'F') {
+        error("Invalid request (%d bytes).", c);
         return -1;
     }
-    *cut = 0;
 
-    char* endptr;
-    long pid = strtol(outbuf, &endptr, 10);
-    if(outbuf == endptr || *endptr != '\0') {
-        error("Invalid pid: %s", outbuf);
+    struct job* job = malloc(sizeof(*job));
+    if (!job || (job->conn = dup(conn)) < 0) {
+        syserror("Cannot queue request.");
+        free(job);
         return -1;
     }
+    job->next = NULL;
+    job->req = req;
+
+    pthread_mutex_lock(&jobs_lock);
+    *jobs_tail = job;
+    jobs_tail = &job->next;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+/* Looks up the buffer of a queued request, and replies to it. */
+static void find_nacl(const struct job* job)
+{
+    /* NaCl-space address of the shared memory. We assume that the
+     * NaCl/hardware memory mapping conserves the address, possibly with a
+     * prefix in the MSBs. Signature is a random 8 byte pattern written at the
+     * beginning of the shared buffer by the NaCl application. */
+    uint32_t addr = job->req.paddr & 0xffffffff;
+    uint8_t sig[SIG_LEN];
+    memcpy(sig, &job->req.sig, SIG_LEN);
 
-    char* file = cut+1;
-    int ret = 0;
-    int fd = -1;
-    if (pid > 0) {
-        if ((fd = open(file, O_RDWR)) < 0)
-            syserror("Cannot open file %s", file);
+    long pid = -1;
+    int fd = find_shm_file(addr, sig, &pid);
+    if (fd < 0) {
+        log(1, "No match for %08x %016llx", addr,
+            (unsigned long long)job->req.sig);
+        pid = -1;
     }
 
-    if (send_pid_fd(conn, pid, fd) < 0) {
-        syserror("FD-passing failed.");
-        ret = -1;
+    if (send_reply(job->conn, job->req.id, pid, fd) < 0) {
+        /* The client may have disconnected while the request was queued.
+         * Otherwise, the main loop closes the connection once it sees the
+         * hangup. */
+        if (errno == EPIPE || errno == ECONNRESET)
+            log(2, "Client gone, dropping reply %u.", job->req.id);
+        else
+            syserror("FD-passing failed.");
+        shutdown(job->conn, SHUT_RDWR);
     }
 
-    close(fd);
-    return ret;
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Lookup thread: runs queued requests, in order */
+static void* lookup_main(void* arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&jobs_lock);
+        while (!jobs)
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        struct job* job = jobs;
+        jobs = job->next;
+        if (!jobs)
+            jobs_tail = &jobs;
+        pthread_mutex_unlock(&jobs_lock);
+
+        find_nacl(job);
+        close(job->conn);
+        free(job);
+    }
+    return NULL;
 }
 
 int main()
 {
-    int sock, conn, fd;
-    int maxfd;
+    int sock, conn, epfd;
     struct sockaddr_un addr;
-    fd_set readset, recvset;
+    struct epoll_event ev, events[MAX_EVENTS];
 
     /* Set egid to be 27 (video) and change the umask to 007,
      * so that normal user can also access the socket if they
@@ -131,58 +454,86 @@ int main()
     }
     umask(S_IROTH | S_IWOTH | S_IXOTH);
 
-    if (mkdir(SOCKET_DIR, 0770) < 0) {
+    if (mkdir(FINDNACL_SOCKET_DIR, 0770) < 0) {
         if (errno != EEXIST) {
-            syserror("Cannot create %s", SOCKET_DIR);
+            syserror("Cannot create %s", FINDNACL_SOCKET_DIR);
             return -1;
         }
     }
 
-    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
         syserror("Failed to create socket.");
         return -1;
     }
 
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path));
+    strncpy(addr.sun_path, FINDNACL_SOCKET_PATH, sizeof(addr.sun_path));
 
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        syserror("Failed to bind address: %s.", SOCKET_PATH);
+        syserror("Failed to bind address: %s.", FINDNACL_SOCKET_PATH);
         return -1;
     }
 
     if (listen(sock, 1024) < 0) {
-        syserror("Failed to listen on %s.", SOCKET_PATH);
+        syserror("Failed to listen on %s.", FINDNACL_SOCKET_PATH);
         return -1;
     }
 
-    FD_ZERO(&readset);
-    FD_SET(sock, &readset);
+    int i;
+    for (i = 0; i < LOOKUP_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, lookup_main, NULL) != 0) {
+            error("Failed to start lookup thread.");
+            return -1;
+        }
+    }
 
-    maxfd = sock;
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        syserror("Failed to create epoll instance.");
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        syserror("Failed to add listening socket.");
+        return -1;
+    }
 
     for (;;) {
-        memcpy(&recvset, &readset, sizeof(recvset));
-        select(maxfd + 1, &recvset, NULL, NULL, NULL);
-
-        for (fd = 0; fd <= maxfd; fd++) {
-            if (FD_ISSET(fd, &recvset)) {
-                if (fd == sock) {
-                    conn = accept(sock, NULL, 0);
-                    if (conn < 0) {
-                        syserror("Connection error.");
-                        continue;
-                    }
-                    if (conn > maxfd)
-                        maxfd = conn;
-                    FD_SET(conn, &readset);
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syserror("epoll_wait failed.");
+            return -1;
+        }
+
+        /* Connections are level-triggered, and only one request is read per
+         * wakeup: a client with many requests in flight cannot starve the
+         * others. Lookups run in the lookup threads. */
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == sock) {
+                conn = accept(sock, NULL, 0);
+                if (conn < 0) {
+                    syserror("Connection error.");
+                    continue;
                 }
-                else {
-                    find_nacl(fd);
-                    close(fd);
-                    FD_CLR(fd, &readset);
+                ev.events = EPOLLIN;
+                ev.data.fd = conn;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn, &ev) < 0) {
+                    syserror("Failed to add connection.");
+                    close(conn);
                 }
+            } else if (read_request(fd) < 0 ||
+                       (events[i].events & (EPOLLHUP | EPOLLERR) &&
+                        !(events[i].events & EPOLLIN))) {
+                /* Queued lookups hold duplicates of the fd: closing it does
+                 * not remove the connection from the epoll set. */
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
             }
         }
     }
@@ -151,7 +151,8 @@ static void pipein_reopen() {
 /* Read data from the pipe, and forward it to the socket client. */
 static void pipein_read() {
     int n;
-    char buffer[FRAMEMAXHEADERSIZE+BUFFERSIZE];
+    char buffer[BUFFERSIZE];
+    struct iovec iov = { .iov_base = buffer };
     int first = 1;
     char firstchar = '\0';
 
@@ -163,7 +164,7 @@ static void pipein_read() {
     }
 
     while (1) {
-        n = read(pipein_fd, buffer+FRAMEMAXHEADERSIZE, BUFFERSIZE);
+        n = read(pipein_fd, buffer, BUFFERSIZE);
         log(3, "n=%d", n);
 
         if (n < 0) {
@@ -175,11 +176,14 @@ static void pipein_read() {
         }
 
         if (first)
-            firstchar = buffer[FRAMEMAXHEADERSIZE];
-
-        /* Write a text frame for the first packet, then cont frames. */
-        n = socket_client_write_frame(buffer, n,
-                                  first ? WS_OPCODE_TEXT : WS_OPCODE_CONT, 0);
+            firstchar = buffer[0];
+
+        /* Write a text frame for the first packet, then cont frames. The
+         * message is always terminated by an empty FIN frame: ask the kernel
+         * to hold on to this one until then. */
+        iov.iov_len = n;
+        n = socket_client_writev_frame(&iov, 1,
+                                first ? WS_OPCODE_TEXT : WS_OPCODE_CONT, 0, 1);
         if (n < 0) {
             error("Error writing frame.");
             pipein_reopen();
@@ -195,7 +199,7 @@ static void pipein_read() {
     pipein_reopen();
 
     /* Empty FIN frame to finish the message. */
-    n = socket_client_write_frame(buffer, 0,
+    n = socket_client_write_frame(NULL, 0,
                                   first ? WS_OPCODE_TEXT : WS_OPCODE_CONT, 1);
     if (n < 0) {
         error("Error writing frame.");
@@ -357,7 +361,7 @@ static int socket_client_handle_unrequested(const char* buffer,
         case 'C': {  /* Send a command to croutoncycle */
             char reply[BUFFERSIZE];
             int replylength = 1;
-            reply[FRAMEMAXHEADERSIZE] = 'C';
+            reply[0] = 'C';
 
             char* cmd = "croutoncycle";
             char param[length];
@@ -370,8 +374,7 @@ static int socket_client_handle_unrequested(const char* buffer,
             /* We are only interested in the output for list commands */
             if (param[0] == 'l') {
                 int n = popen2(cmd, args, NULL, 0,
-                               &reply[FRAMEMAXHEADERSIZE+1],
-                               BUFFERSIZE-FRAMEMAXHEADERSIZE-1);
+                               &reply[1], BUFFERSIZE-1);
                 if (n < 0) {
                     error("Call to croutoncycle failed.");
                     socket_client_close(0);
@@ -523,6 +526,13 @@ int main(int argc, char **argv) {
     pipe_init();
 
     while (!terminate) {
+        /* Frames that were already read from the socket do not show up in
+         * poll: handle them first. */
+        if (socket_client_pending()) {
+            socket_client_read();
+            continue;
+        }
+
         /* Make sure fds is up to date. */
         fds[0].fd = server_fd;
         fds[1].fd = pipein_fd;
@@ -5,6 +5,9 @@
  * Provides common WebSocket functions that can be used by both websocket.c
  * and fbserver.c.
  *
+ * Helpers that only some of the users need (server side, popen2) are marked
+ * unused, so that the others build with -Werror.
+ *
  * Mostly compliant with RFC 6455 - The WebSocket Protocol.
  *
  * Things that are supported, but not tested:
@@ -19,17 +22,23 @@
 #include <ctype.h>
 #include <errno.h>
 #include <poll.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 const int BUFFERSIZE = 4096;
 
 /* WebSocket constants */
-const int FRAMEMAXHEADERSIZE = 16; // Actually 2+8, but align on 8-byte boundary
+const int FRAMEMAXHEADERSIZE = 10; /* 2 bytes, and 8 bytes extended length */
 const int MAXFRAMESIZE = 16*1048576; // 16MiB
 const char* GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 /* Key from client must be 24 bytes long (16 bytes, base64 encoded) */
@@ -86,9 +95,18 @@ static int port = -1;
 static int server_fd = -1;
 static int client_fd = -1;
 
+/* Data read from client_fd, but not consumed yet: small frames are read
+ * several at a time, with a single read call. */
+#define CLIENT_RBUFSIZE 16384
+static char client_rbuf[CLIENT_RBUFSIZE];
+static int client_rbuf_start = 0;
+static int client_rbuf_end = 0;
+
 /* Prototypes */
-static int socket_client_write_frame(char* buffer, unsigned int size,
+static int socket_client_write_frame(const char* buffer, unsigned int size,
                                      unsigned int opcode, int fin);
+static int socket_client_writev_frame(const struct iovec* iov, int iovcnt,
+                                      unsigned int opcode, int fin, int more);
 static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
                                            int* length);
 static int socket_client_read_frame_data(char* buffer, unsigned int size,
@@ -118,6 +136,49 @@ static int block_read(int fd, char* buffer, size_t size) {
     return tot;
 }
 
+/* Read exactly size bytes from the client, through client_rbuf.
+ * Returns size if successful, < 0 in case of error. */
+static int client_read(char* buffer, size_t size) {
+    int tot = client_rbuf_end - client_rbuf_start;
+
+    if (tot >= size) {
+        memcpy(buffer, client_rbuf + client_rbuf_start, size);
+        client_rbuf_start += size;
+        return size;
+    }
+
+    /* Consume what is buffered, then refill */
+    memcpy(buffer, client_rbuf + client_rbuf_start, tot);
+    client_rbuf_start = client_rbuf_end = 0;
+
+    /* Large payloads are read in place */
+    if (size - tot >= CLIENT_RBUFSIZE) {
+        int n = block_read(client_fd, buffer + tot, size - tot);
+        return n < 0 ? n : size;
+    }
+
+    while (client_rbuf_end < size - tot) {
+        int n = read(client_fd, client_rbuf + client_rbuf_end,
+                     CLIENT_RBUFSIZE - client_rbuf_end);
+        log(3, "n=%d+%d/%zd", n, client_rbuf_end, size - tot);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            return -1;  /* EOF */
+        client_rbuf_end += n;
+    }
+
+    client_rbuf_start = size - tot;
+    memcpy(buffer + tot, client_rbuf, client_rbuf_start);
+    return size;
+}
+
+/* Returns true if data from the client is buffered: the next frame header
+ * can then be read without waiting for the socket to be readable. */
+static int __attribute__((unused)) socket_client_pending() {
+    return client_rbuf_end > client_rbuf_start;
+}
+
 /* Write exactly size bytes from fd, no matter how many writes it takes.
  * Returns size if successful, < 0 in case of error. */
 static int block_write(int fd, char* buffer, size_t size) {
@@ -137,11 +198,43 @@ static int block_write(int fd, char* buffer, size_t size) {
     return tot;
 }
 
+/* Send all the data described by iov to socket fd, no matter how many calls
+ * it takes. iov is modified in the process. flags are passed to sendmsg
+ * (e.g. MSG_MORE). Returns the number of bytes sent, < 0 in case of error. */
+static int block_sendmsg(int fd, struct iovec* iov, int iovcnt, int flags) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    int n;
+    int tot = 0;
+
+    while (msg.msg_iovlen > 0) {
+        n = sendmsg(fd, &msg, flags);
+        log(3, "n=%d+%d", n, tot);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            return -1;
+        tot += n;
+
+        /* Skip what was sent */
+        while (msg.msg_iovlen > 0 && n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (n > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return tot;
+}
+
 /* Run external command, piping some data on its stdin, and reading back
  * the output. Returns the number of bytes read from the process (at most
  * outlen), or a negative number on error (-exit status). */
-static int popen2(char* cmd, char *const argv[],
-                  char* input, int inlen, char* output, int outlen) {
+static int __attribute__((unused)) popen2(char* cmd, char *const argv[],
+        char* input, int inlen, char* output, int outlen) {
     pid_t pid = 0;
     int stdin_fd[2];
     int stdout_fd[2];
@@ -298,6 +391,171 @@ static int popen2(char* cmd, char *const argv[],
     return readlen;
 }
 
+/**/
+/* Hash/encoding functions, for the handshake */
+/**/
+
+static inline uint32_t sha1_rol(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+/* Processes one 64-byte block of SHA-1 input. */
+static void sha1_block(uint32_t h[5], const uint8_t* block) {
+    uint32_t w[80];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16 |
+               (uint32_t)block[4*i+2] << 8 | block[4*i+3];
+    }
+    for (; i < 80; i++)
+        w[i] = sha1_rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = sha1_rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = sha1_rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+/* Computes the SHA-1 hash (FIPS 180-4) of len bytes of data, into out,
+ * which must be SHA1_LEN bytes long. */
+static void sha1(const char* data, size_t len, char* out) {
+    uint32_t h[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    uint8_t block[64];
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64)
+        sha1_block(h, (const uint8_t*)data + i);
+
+    /* Padding: 0x80, zeros, then the length in bits (big-endian) */
+    size_t rem = len - i;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + i, rem);
+    block[rem] = 0x80;
+    if (rem >= 56) {
+        sha1_block(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (i = 0; i < 8; i++)
+        block[63-i] = bits >> (8*i);
+    sha1_block(h, block);
+
+    for (i = 0; i < 20; i++)
+        out[i] = h[i/4] >> (24 - 8*(i%4));
+}
+
+/* Encodes len bytes of data in base64 (RFC 4648), with padding. out must be
+ * at least 4*ceil(len/3)+1 bytes long, and is null-terminated.
+ * Returns the length of the output. */
+static int base64_encode(const char* data, size_t len, char* out) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const uint8_t* in = (const uint8_t*)data;
+    int n = 0;
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i += 3) {
+        uint32_t v = in[i] << 16 | in[i+1] << 8 | in[i+2];
+        out[n++] = table[v >> 18];
+        out[n++] = table[(v >> 12) & 0x3F];
+        out[n++] = table[(v >> 6) & 0x3F];
+        out[n++] = table[v & 0x3F];
+    }
+
+    if (i < len) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < len)
+            v |= in[i+1] << 8;
+        out[n++] = table[v >> 18];
+        out[n++] = table[(v >> 12) & 0x3F];
+        out[n++] = (i + 1 < len) ? table[(v >> 6) & 0x3F] : '=';
+        out[n++] = '=';
+    }
+
+    out[n] = '\0';
+    return n;
+}
+
+/* Computes the Sec-WebSocket-Accept value for a client key (RFC 6455
+ * section 4.2.2, paragraph 5.4): base64 of the SHA-1 of key + GUID.
+ * out must be at least SHA1_BASE64_LEN+1 bytes long. */
+static void websocket_accept_key(const char* key, char* out) {
+    int keylen = SECKEY_LEN + strlen(GUID);
+    char buffer[keylen];
+    char hash[SHA1_LEN];
+
+    memcpy(buffer, key, SECKEY_LEN);
+    memcpy(buffer + SECKEY_LEN, GUID, strlen(GUID));
+    sha1(buffer, keylen, hash);
+    base64_encode(hash, SHA1_LEN, out);
+}
+
+/* XORs size bytes of buffer with the 4-byte mask key, in network order as
+ * received (RFC 6455 section 5.3). buffer can have any alignment and size:
+ * vector and word accesses are unaligned, which costs nothing on current
+ * CPUs, and keeps the key in phase without rotating it. */
+static void websocket_unmask(char* buffer, size_t size, uint32_t maskkey) {
+    uint8_t* p = (uint8_t*)buffer;
+    uint8_t* end = p + size;
+    uint64_t key64 = (uint64_t)maskkey << 32 | maskkey;
+
+#if defined(__AVX2__)
+    __m256i vkey = _mm256_set1_epi32(maskkey);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)p);
+        _mm256_storeu_si256((__m256i*)p, _mm256_xor_si256(v, vkey));
+    }
+#elif defined(__SSE2__)
+    __m128i vkey = _mm_set1_epi32(maskkey);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)p);
+        _mm_storeu_si128((__m128i*)p, _mm_xor_si128(v, vkey));
+    }
+#endif
+
+    /* memcpy compiles to plain (unaligned) loads and stores */
+    for (; end - p >= 8; p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= key64;
+        memcpy(p, &v, 8);
+    }
+
+    /* Tail: all blocks above are multiples of 4 bytes long */
+    const uint8_t* key = (const uint8_t*)&maskkey;
+    int k;
+    for (k = 0; p < end; k++)
+        *p++ ^= key[k & 3];
+}
+
 /**/
 /* Websocket functions. */
 /**/
@@ -308,8 +566,7 @@ static void socket_client_close(int sendclose) {
         return;
 
     if (sendclose) {
-        char buffer[FRAMEMAXHEADERSIZE];
-        socket_client_write_frame(buffer, 0, WS_OPCODE_CLOSE, 1);
+        socket_client_write_frame(NULL, 0, WS_OPCODE_CLOSE, 1);
         /* FIXME: We are supposed to read back the answer (if we are not
          * replying to a close frame sent by the client), but we probably do not
          * want to block, waiting for the answer, so we just close the socket.
@@ -318,23 +575,33 @@ static void socket_client_close(int sendclose) {
 
     close(client_fd);
     client_fd = -1;
+    client_rbuf_start = client_rbuf_end = 0;
 }
 
-/* Send a frame to the WebSocket client.
- *  - buffer needs to be FRAMEMAXHEADERSIZE+size long, and data must start at
- *    buffer[FRAMEMAXHEADERSIZE] only.
+/* Send a frame to the WebSocket client, made of iovcnt chunks of data.
  *  - opcode should generally be WS_OPCODE_TEXT or WS_OPCODE_CONT (continuation)
  *  - fin indicates if the this is the last frame in the message
- * Returns size on success. On error, closes the socket, and returns -1.
+ *  - more indicates that another frame follows shortly: the kernel may then
+ *    coalesce them in a single TCP segment (MSG_MORE).
+ * Returns the payload size on success. On error, closes the socket, and
+ * returns -1.
  */
-static int socket_client_write_frame(char* buffer, unsigned int size,
-                                     unsigned int opcode, int fin) {
-    /* Start of frame, with header: at least 2 bytes before the actual data */
-    char* pbuffer = buffer + FRAMEMAXHEADERSIZE - 2;
-    int payloadlen = size;
+static int socket_client_writev_frame(const struct iovec* iov, int iovcnt,
+                                      unsigned int opcode, int fin, int more) {
+    char header[FRAMEMAXHEADERSIZE];
+    struct iovec fulliov[1 + iovcnt];
+    unsigned int size = 0;
+    int payloadlen;
     int extlensize = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+        fulliov[1 + i] = iov[i];
+    }
 
     /* Test if we need an extended length field. */
+    payloadlen = size;
     if (payloadlen > 125) {
         if (payloadlen < 65536) {
             payloadlen = 126;
@@ -343,23 +610,25 @@ static int socket_client_write_frame(char* buffer, unsigned int size,
             payloadlen = 127;
             extlensize = 8;
         }
-        pbuffer -= extlensize;
 
         /* Network-order (big-endian) */
         unsigned int tmpsize = size;
-        int i;
         for (i = extlensize-1; i >= 0; i--) {
-            pbuffer[2+i] = tmpsize & 0xff;
+            header[2+i] = tmpsize & 0xff;
             tmpsize >>= 8;
         }
     }
 
-    pbuffer[0] = opcode & WS_HEADER0_OPCODE_MASK;
-    if (fin) pbuffer[0] |= WS_HEADER0_FIN;
-    pbuffer[1] = payloadlen;  /* No mask (0x80) in server->client direction */
+    header[0] = opcode & WS_HEADER0_OPCODE_MASK;
+    if (fin) header[0] |= WS_HEADER0_FIN;
+    header[1] = payloadlen;  /* No mask (0x80) in server->client direction */
+
+    fulliov[0].iov_base = header;
+    fulliov[0].iov_len = 2 + extlensize;
 
     int wlen = 2 + extlensize + size;
-    if (block_write(client_fd, pbuffer, wlen) != wlen) {
+    if (block_sendmsg(client_fd, fulliov, 1 + iovcnt,
+                      more ? MSG_MORE : 0) != wlen) {
         syserror("Write error.");
         socket_client_close(0);
         return -1;
@@ -368,6 +637,15 @@ static int socket_client_write_frame(char* buffer, unsigned int size,
     return size;
 }
 
+/* Send a frame to the WebSocket client, with size bytes of data from buffer.
+ * See socket_client_writev_frame for the other parameters.
+ */
+static int socket_client_write_frame(const char* buffer, unsigned int size,
+                                     unsigned int opcode, int fin) {
+    struct iovec iov = { .iov_base = (char*)buffer, .iov_len = size };
+    return socket_client_writev_frame(&iov, 1, opcode, fin, 0);
+}
+
 /* Read a WebSocket frame header:
  *  - fin indicates in this is the final frame in a fragmented message
  *  - maskkey is the XOR key used for the message
@@ -387,7 +665,7 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
 
     *retry = 0;
 
-    n = block_read(client_fd, header, 2);
+    n = client_read(header, 2);
     if (n != 2) {
         error("Read error.");
         socket_client_close(0);
@@ -417,7 +695,7 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
         extlensize = 8;
 
     if (extlensize > 0) {
-        n = block_read(client_fd, extlen, extlensize);
+        n = client_read(extlen, extlensize);
         if (n != extlensize) {
             error("Read error.");
             socket_client_close(0);
@@ -436,7 +714,7 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
 
     /* Read masking key if necessary */
     if (mask) {
-        n = block_read(client_fd, (char*)maskkey, 4);
+        n = client_read((char*)maskkey, 4);
         if (n != 4) {
             error("Read error.");
             socket_client_close(0);
@@ -475,7 +753,7 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
         }
 
         /* Read the rest of the packet */
-        char* buffer = malloc(length+3); /* +3 for unmasking safety */
+        char* buffer = malloc(length);
         if (socket_client_read_frame_data(buffer, length, *maskkey) < 0) {
             socket_client_close(0);
             free(buffer);
@@ -509,35 +787,26 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
     return length;
 }
 
-/* Read frame data from the WebSocket client:
- * - Make sure that buffer is at least 4*ceil(size/4) long, as unmasking works
- *   on blocks of 4 bytes.
+/* Read frame data from the WebSocket client.
  * Returns size on success (the buffer has been completely filled).
  * On error, closes the socket, and returns -1.
  */
 static int socket_client_read_frame_data(char* buffer, unsigned int size,
                                          uint32_t maskkey) {
-    int n = block_read(client_fd, buffer, size);
+    int n = client_read(buffer, size);
     if (n != size) {
         error("Read error.");
         socket_client_close(0);
         return -1;
     }
 
-    if (maskkey != 0) {
-        int i;
-        int len32 = (size+3)/4;
-        uint32_t* buffer32 = (uint32_t*)buffer;
-        for (i = 0; i < len32; i++) {
-            buffer32[i] ^= maskkey;
-        }
-    }
+    if (maskkey != 0)
+        websocket_unmask(buffer, size, maskkey);
 
     return n;
 }
 
-/* Read a complete frame from the WebSocket client:
- * - Make sure that buffer size is a multiple of 4 (for unmasking).
+/* Read a complete frame from the WebSocket client.
  * Returns packet size on success.
  * On error (e.g. packet too large for buffer), closes the socket, and
  * returns -1.
@@ -577,18 +846,14 @@ static int socket_client_read_frame(char* buffer, int size) {
 /* Send a version packet to the extension, and read VOK reply. */
 static int socket_client_sendversion(char* version) {
     int versionlen = strlen(version);
-    char* outbuf = malloc(FRAMEMAXHEADERSIZE + versionlen);
-    memcpy(outbuf + FRAMEMAXHEADERSIZE, version, versionlen);
 
     log(2, "Sending version packet (%s).", version);
 
-    if (socket_client_write_frame(outbuf, versionlen, WS_OPCODE_TEXT, 1) < 0) {
+    if (socket_client_write_frame(version, versionlen, WS_OPCODE_TEXT, 1) < 0) {
         error("Write error.");
         socket_client_close(0);
-        free(outbuf);
         return -1;
     }
-    free(outbuf);
 
     /* Read response back */
     char buffer[256];
@@ -803,7 +1068,7 @@ static int socket_server_read_header(int newclient_fd, char* websocket_key) {
 }
 
 /* Accept a new client connection on the server socket. */
-static int socket_server_accept(char* version) {
+static int __attribute__((unused)) socket_server_accept(char* version) {
     int newclient_fd;
     struct sockaddr_in client_addr;
     unsigned int client_addr_len = sizeof(client_addr);
@@ -817,9 +1082,8 @@ static int socket_server_accept(char* version) {
         return -1;
     }
 
-    /* key from client + GUID */
-    int websocket_keylen = SECKEY_LEN + strlen(GUID);
-    char websocket_key[websocket_keylen];
+    /* key from client */
+    char websocket_key[SECKEY_LEN];
 
     /* Read and parse HTTP header */
     if (socket_server_read_header(newclient_fd, websocket_key) < 0) {
@@ -829,46 +1093,8 @@ static int socket_server_accept(char* version) {
     log(1, "Header read successfully.");
 
     /* Compute sha1+base64 response (RFC section 4.2.2, paragraph 5.4) */
-
-    char sha1[SHA1_LEN];
-
-    /* Some margin so we can read the full output of base64 */
-    int b64_len = SHA1_BASE64_LEN + 4;
-    char b64[b64_len];
-    int i;
-
-    memcpy(websocket_key + SECKEY_LEN, GUID, strlen(GUID));
-
-    /* SHA-1 is 20 bytes long (40 characters in hex form) */
-    if (popen2("sha1sum", NULL, websocket_key, websocket_keylen,
-               buffer, BUFFERSIZE) < 2*SHA1_LEN) {
-        error("sha1sum response too short.");
-        exit(1);
-    }
-
-    /* Make sure sscanf does not read too much data */
-    buffer[2*SHA1_LEN + 1] = '\0';
-    for (i = 0; i < SHA1_LEN; i++) {
-        unsigned int value;
-        if (sscanf(&buffer[i*2], "%02x", &value) != 1) {
-            buffer[2*SHA1_LEN] = 0;
-            error("Cannot read SHA-1 sum (%s).", buffer);
-            exit(1);
-        }
-        sha1[i] = (char)value;
-    }
-
-    /* base64 encoding of SHA1_LEN bytes must be SHA1_BASE64_LEN bytes long.
-     * Either the output is exactly SHA1_BASE64_LEN long, or the last character
-     * is a line feed (RFC 3548 forbids other characters in output) */
-    int n = popen2("base64", NULL, sha1, SHA1_LEN, b64, b64_len);
-    if (n < SHA1_BASE64_LEN ||
-            (n != SHA1_BASE64_LEN && b64[SHA1_BASE64_LEN] != '\r' &&
-             b64[SHA1_BASE64_LEN] != '\n')) {
-        error("Invalid base64 response.");
-        exit(1);
-    }
-    b64[SHA1_BASE64_LEN] = '\0';
+    char b64[SHA1_BASE64_LEN + 1];
+    websocket_accept_key(websocket_key, b64);
 
     int len = snprintf(buffer, BUFFERSIZE,
                        "HTTP/1.1 101 Switching Protocols\r\n"
@@ -897,12 +1123,13 @@ static int socket_server_accept(char* version) {
         socket_client_close(1);
 
     client_fd = newclient_fd;
+    client_rbuf_start = client_rbuf_end = 0;
 
     return socket_client_sendversion(version);
 }
 
 /* Initialise WebSocket server */
-static void socket_server_init(int port_) {
+static void __attribute__((unused)) socket_server_init(int port_) {
     struct sockaddr_in server_addr;
     int optval;
 
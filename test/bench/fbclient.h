@@ -0,0 +1,407 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Stand-in for the NaCl side of croutonfbserver (kiwi), so that fbserver can
+ * be exercised without Chromium:
+ *  - WebSocket client, speaking the protocol in fbserver-proto.h
+ *  - Frame buffers allocated with memfd, registered in the ring
+ *  - Stand-in findnacld, handing these buffers over to fbserver (which must
+ *    be started with -s, pointing to the socket passed to
+ *    fb_findnacl_listen)
+ */
+
+#ifndef FBCLIENT_H_
+#define FBCLIENT_H_
+
+#include "../../src/websocket.h"
+#include "../../src/fbserver-proto.h"
+#include "../../src/findnacld-proto.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+/* A frame buffer, shared with fbserver */
+struct fb_buffer {
+    int fd;
+    char* map;
+    size_t size;
+    uint16_t width;
+    uint16_t height;
+    uint64_t sig;  /* Signature at the beginning of the buffer */
+};
+
+static int fb_ws = -1;  /* WebSocket connection to fbserver */
+static int fb_findnacl_server = -1;  /* Stand-in findnacld socket */
+static int fb_findnacl_conn = -1;  /* Connection from fbserver */
+static struct fb_buffer fb_buffers[MAX_BUFFERS];
+static unsigned long fb_lookups;  /* Lookups answered by the stand-in */
+
+/* Returns CLOCK_MONOTONIC time, in ns. */
+static uint64_t fb_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**/
+/* WebSocket client */
+/**/
+
+/* Sends a frame to fbserver. Client frames must be masked: the mask key is
+ * 0, so that the payload can be sent as is. Returns 0 on success. */
+static int fb_send(const void* data, size_t size, int opcode) {
+    char header[2 + 8 + 4];
+    int hlen = 2;
+
+    header[0] = WS_HEADER0_FIN | opcode;
+    if (size < 126) {
+        header[1] = WS_HEADER1_MASK | size;
+    } else if (size < 65536) {
+        header[1] = WS_HEADER1_MASK | 126;
+        header[hlen++] = size >> 8;
+        header[hlen++] = size;
+    } else {
+        int i;
+        header[1] = WS_HEADER1_MASK | 127;
+        for (i = 7; i >= 0; i--)
+            header[hlen++] = (uint64_t)size >> (8*i);
+    }
+    memset(header + hlen, 0, 4);
+    hlen += 4;
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = hlen },
+        { .iov_base = (void*)data, .iov_len = size },
+    };
+    if (block_sendmsg(fb_ws, iov, 2, MSG_NOSIGNAL) != hlen + size) {
+        syserror("Cannot send frame.");
+        return -1;
+    }
+    return 0;
+}
+
+/* Receives a complete frame from fbserver into buffer. Returns the payload
+ * size, or -1 on error (including frames larger than size). */
+static int fb_recv(char* buffer, int size) {
+    unsigned char header[8];
+    uint64_t length;
+    int i;
+
+    if (block_read(fb_ws, (char*)header, 2) != 2) {
+        error("Connection closed.");
+        return -1;
+    }
+    length = header[1] & WS_HEADER1_LEN_MASK;
+    if (length >= 126) {
+        int extlen = length == 126 ? 2 : 8;
+        if (block_read(fb_ws, (char*)header, extlen) != extlen)
+            return -1;
+        length = 0;
+        for (i = 0; i < extlen; i++)
+            length = length << 8 | header[i];
+    }
+
+    if ((header[0] & WS_HEADER0_OPCODE_MASK) == WS_OPCODE_CLOSE) {
+        error("Close frame from server.");
+        return -1;
+    }
+    if (length > size) {
+        error("Frame too large (%llu > %d).", (unsigned long long)length,
+              size);
+        return -1;
+    }
+    if (block_read(fb_ws, buffer, length) != length)
+        return -1;
+
+    return length;
+}
+
+/* Connects to fbserver on port, and goes through the WebSocket handshake
+ * and the version exchange. Returns 0 on success. */
+static int fb_connect(int port) {
+    struct sockaddr_in addr = { 0 };
+    char buffer[BUFFERSIZE];
+    char key[SECKEY_LEN + 1];
+    char acceptkey[SHA1_BASE64_LEN + 1];
+    uint32_t nonce[4];
+    int i, len;
+
+    fb_ws = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fb_ws < 0) {
+        syserror("Cannot create socket.");
+        return -1;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fb_ws, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fb_ws);
+        fb_ws = -1;
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fb_ws, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    for (i = 0; i < 4; i++)
+        nonce[i] = rand();
+    base64_encode((char*)nonce, sizeof(nonce), key);
+    len = snprintf(buffer, sizeof(buffer),
+                   "GET / HTTP/1.1\r\n"
+                   "Host: localhost:%d\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: %s\r\n"
+                   "Sec-WebSocket-Version: 13\r\n"
+                   "\r\n", port, key);
+    if (block_write(fb_ws, buffer, len) != len) {
+        syserror("Cannot send request.");
+        return -1;
+    }
+
+    /* Read the response, one byte at a time, up to the empty line */
+    for (len = 0; len < sizeof(buffer) - 1; len++) {
+        if (read(fb_ws, buffer + len, 1) != 1) {
+            error("Connection closed during handshake.");
+            return -1;
+        }
+        if (len >= 3 && !memcmp(buffer + len - 3, "\r\n\r\n", 4))
+            break;
+    }
+    buffer[len] = '\0';
+    websocket_accept_key(key, acceptkey);
+    if (strncmp(buffer, "HTTP/1.1 101", 12) || !strstr(buffer, acceptkey)) {
+        error("Invalid handshake response:\n%s", buffer);
+        return -1;
+    }
+
+    len = fb_recv(buffer, sizeof(buffer) - 1);
+    if (len < 0)
+        return -1;
+    buffer[len] = '\0';
+    if (strcmp(buffer, VERSION)) {
+        error("Invalid server version (%s), expecting %s.", buffer, VERSION);
+        return -1;
+    }
+    return fb_send("VOK", 3, WS_OPCODE_TEXT);
+}
+
+/**/
+/* Frame buffers */
+/**/
+
+/* Allocates buffer index (width x height) in memfd shared memory.
+ * Returns 0 on success. */
+static int fb_buffer_alloc(int index, int width, int height) {
+    struct fb_buffer* b = &fb_buffers[index];
+
+    b->size = (size_t)width*height*4;
+    b->width = width;
+    b->height = height;
+    b->sig = (uint64_t)rand() << 32 ^ rand();
+
+    /* memfd_create may not be exposed by older C libraries */
+    b->fd = syscall(SYS_memfd_create, "fbclient", 1 /* MFD_CLOEXEC */);
+    if (b->fd < 0 || ftruncate(b->fd, b->size) < 0) {
+        syserror("Cannot allocate shared memory.");
+        return -1;
+    }
+    b->map = mmap(NULL, b->size, PROT_READ|PROT_WRITE, MAP_SHARED, b->fd, 0);
+    if (b->map == MAP_FAILED) {
+        syserror("Cannot mmap.");
+        b->map = NULL;
+        return -1;
+    }
+    memcpy(b->map, &b->sig, sizeof(b->sig));
+    return 0;
+}
+
+/* Releases buffer index */
+static void fb_buffer_free(int index) {
+    struct fb_buffer* b = &fb_buffers[index];
+    if (b->map)
+        munmap(b->map, b->size);
+    if (b->size && b->fd >= 0)
+        close(b->fd);
+    memset(b, 0, sizeof(*b));
+}
+
+/* Registers buffer index in fbserver's ring */
+static int fb_register(int index) {
+    struct fb_buffer* b = &fb_buffers[index];
+    struct buffer r = { 0 };
+    r.type = 'B';
+    r.index = index;
+    r.width = b->width;
+    r.height = b->height;
+    r.paddr = (uint64_t)(uintptr_t)b->map;
+    r.sig = b->sig;
+    return fb_send(&r, sizeof(r), WS_OPCODE_BINARY);
+}
+
+/* Requests a frame in buffer index */
+static int fb_request(int index, int refresh) {
+    struct fb_buffer* b = &fb_buffers[index];
+    struct screen s = { 0 };
+    s.type = 'S';
+    s.shm = 1;
+    s.refresh = refresh;
+    s.ring = 1;
+    s.buffer = index;
+    s.width = b->width;
+    s.height = b->height;
+    s.paddr = (uint64_t)(uintptr_t)b->map;
+    s.sig = b->sig;
+    /* The signature was overwritten by the previous frame */
+    memcpy(b->map, &b->sig, sizeof(b->sig));
+    return fb_send(&s, sizeof(s), WS_OPCODE_BINARY);
+}
+
+/**/
+/* Stand-in findnacld */
+/**/
+
+/* Listens for fbserver lookups on path. Returns 0 on success. */
+static int fb_findnacl_listen(const char* path) {
+    struct sockaddr_un addr = { 0 };
+
+    fb_findnacl_server = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if (fb_findnacl_server < 0) {
+        syserror("Cannot create socket.");
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(fb_findnacl_server, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fb_findnacl_server, 1) < 0) {
+        syserror("Cannot listen on %s.", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Answers one lookup from fbserver: the buffer at paddr is passed if its
+ * signature matches. */
+static void fb_findnacl_reply() {
+    struct findnacl_request req;
+    struct findnacl_reply reply = { 0 };
+    int i, fd = -1;
+
+    int n = recv(fb_findnacl_conn, &req, sizeof(req), 0);
+    if (n != sizeof(req) || req.type != 'F') {
+        if (n != 0)
+            error("Invalid lookup (%d bytes).", n);
+        close(fb_findnacl_conn);
+        fb_findnacl_conn = -1;
+        return;
+    }
+
+    for (i = 0; i < MAX_BUFFERS; i++) {
+        struct fb_buffer* b = &fb_buffers[i];
+        if (b->map && (uint64_t)(uintptr_t)b->map == req.paddr &&
+            !memcmp(b->map, &req.sig, sizeof(req.sig))) {
+            fd = b->fd;
+            break;
+        }
+    }
+    log(2, "Lookup %u: %p -> %d", req.id, (void*)(uintptr_t)req.paddr, fd);
+
+    reply.type = 'F';
+    reply.id = req.id;
+    reply.pid = fd >= 0 ? getpid() : -1;
+
+    struct iovec iov = { .iov_base = &reply, .iov_len = sizeof(reply) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(fb_findnacl_conn, &msg, MSG_NOSIGNAL) < 0)
+        syserror("Cannot send lookup reply.");
+    fb_lookups++;
+}
+
+/* Waits up to timeout_ms (-1: forever) for a frame from fbserver, answering
+ * lookups in the meantime. Returns 1 if a frame can be read with fb_recv,
+ * 0 on timeout, -1 on error. */
+static int fb_wait(int timeout_ms) {
+    uint64_t deadline = fb_now_ns() + timeout_ms*1000000LL;
+
+    while (1) {
+        struct pollfd fds[3] = {
+            { .fd = fb_ws, .events = POLLIN },
+            { .fd = fb_findnacl_server, .events = POLLIN },
+            { .fd = fb_findnacl_conn, .events = POLLIN },
+        };
+        int timeout = -1;
+        if (timeout_ms >= 0) {
+            int64_t left = deadline - fb_now_ns();
+            timeout = left > 0 ? (left + 999999) / 1000000 : 0;
+        }
+
+        int n = poll(fds, 3, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syserror("poll");
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+
+        if (fds[1].revents & POLLIN) {
+            if (fb_findnacl_conn >= 0)
+                close(fb_findnacl_conn);
+            fb_findnacl_conn = accept4(fb_findnacl_server, NULL, NULL,
+                                       SOCK_CLOEXEC);
+        }
+        if (fds[2].revents & (POLLIN|POLLHUP))
+            fb_findnacl_reply();
+        if (fds[0].revents & (POLLIN|POLLHUP|POLLERR))
+            return 1;
+    }
+}
+
+/* Waits for a reply of the given type, skipping other packets (e.g.
+ * initialization info or cursor updates). Returns the payload size, 0 on
+ * timeout, -1 on error. */
+static int fb_wait_reply(char type, char* buffer, int size, int timeout_ms) {
+    while (1) {
+        int n = fb_wait(timeout_ms);
+        if (n <= 0)
+            return n;
+        n = fb_recv(buffer, size);
+        if (n < 0)
+            return -1;
+        if (n > 0 && buffer[0] == type)
+            return n;
+        log(2, "Skipping packet '%c' (%d bytes).", n > 0 ? buffer[0] : ' ', n);
+    }
+}
+
+/* Closes all connections, and frees the buffers */
+static void fb_disconnect() {
+    int i;
+    if (fb_ws >= 0)
+        close(fb_ws);
+    fb_ws = -1;
+    if (fb_findnacl_conn >= 0)
+        close(fb_findnacl_conn);
+    fb_findnacl_conn = -1;
+    for (i = 0; i < MAX_BUFFERS; i++)
+        fb_buffer_free(i);
+}
+
+#endif /* FBCLIENT_H_ */
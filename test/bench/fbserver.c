@@ -0,0 +1,340 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Measures the croutonfbserver capture path, end to end: starts a headless X
+ * server (Xvfb) and croutonfbserver, draws synthetic damage patterns, and
+ * requests frames through the stand-in client in fbclient.h.
+ *
+ * Usage: fbserver [-v 0-3] [-t seconds] [-d display] [-g WIDTHxHEIGHT]
+ *                 [-x croutonfbserver] [pattern...]
+ * Patterns are idle (blinking caret), scroll (scrolling text area) and video
+ * (full screen updates), all of them by default.
+ * Exits successfully, without measuring anything, if Xvfb or croutonfbserver
+ * cannot be found.
+ */
+
+#include "fbclient.h"
+#include <signal.h>
+#include <X11/Xlib.h>
+
+/* Buffers used in turn in the ring */
+#define NBUFFERS 2
+
+static Display* dpy;
+static Window win;
+static GC gc;
+static int width = 1280;
+static int height = 800;
+static int step;  /* Number of steps drawn in the current pattern */
+
+/* Blinking caret: a 2x16 area changes every frame */
+static void draw_idle() {
+    XSetForeground(dpy, gc, (step & 1) ? 0x000000 : 0xffffff);
+    XFillRectangle(dpy, win, gc, 100, 100, 2, 16);
+}
+
+/* Terminal-like 640x480 text area, scrolled up by one line every frame */
+static void draw_scroll() {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%d: the quick brown fox", step);
+    XCopyArea(dpy, win, win, gc, 0, 16, 640, 480 - 16, 0, 0);
+    XSetForeground(dpy, gc, 0xffffff);
+    XFillRectangle(dpy, win, gc, 0, 480 - 16, 640, 16);
+    XSetForeground(dpy, gc, 0x000000);
+    XDrawString(dpy, win, gc, 4, 480 - 4, line, len);
+}
+
+/* Full screen video: the whole window changes every frame */
+static void draw_video() {
+    XSetForeground(dpy, gc, (step * 0x010305) & 0xffffff);
+    XFillRectangle(dpy, win, gc, 0, 0, width, height);
+}
+
+static const struct pattern {
+    const char* name;
+    void (*draw)();
+} patterns[] = {
+    { "idle", draw_idle },
+    { "scroll", draw_scroll },
+    { "video", draw_video },
+};
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Requests timing statistics from fbserver, and prints the average duration
+ * of each stage. If reset is true, statistics are only cleared. */
+static void print_stats(int reset) {
+    static const char* names[STATS_STAGES] = {
+        "events", "find_shm", "capture", "convert", "copy", "reply",
+        "frame"
+    };
+    char buffer[sizeof(struct stats_reply)];
+    struct stats t = { .type = 'T', .reset = reset };
+    int i, j;
+
+    if (fb_send(&t, sizeof(t), WS_OPCODE_BINARY) < 0 ||
+        fb_wait_reply('T', buffer, sizeof(buffer), 2000) != sizeof(buffer)) {
+        error("Cannot get statistics.");
+        return;
+    }
+    if (reset)
+        return;
+
+    struct stats_reply* r = (struct stats_reply*)buffer;
+    printf("         server:");
+    for (i = 0; i < STATS_STAGES; i++) {
+        uint64_t count = 0;
+        for (j = 0; j < STATS_BUCKETS; j++)
+            count += r->counts[i][j];
+        if (count > 0)
+            printf(" %s %.1f us", names[i], (double)r->total_us[i] / count);
+    }
+    printf("\n");
+}
+
+/* Draws pattern and requests frames for the given number of seconds, then
+ * prints fps, damaged bytes per frame and frame latency (from the end of the
+ * drawing to the reply). Returns 0 on success. */
+static int run_pattern(const struct pattern* p, double seconds) {
+    char buffer[BUFFERSIZE];
+    int maxframes = 1024;
+    uint64_t* latencies = malloc(maxframes*sizeof(*latencies));
+    int frames = 0, failed = 0, index = 0, i;
+    uint64_t bytes = 0;
+
+    print_stats(1);
+
+    uint64_t start = fb_now_ns();
+    uint64_t end = start + seconds*1e9;
+    for (step = 0; fb_now_ns() < end; step++) {
+        p->draw();
+        XSync(dpy, False);
+
+        uint64_t t0 = fb_now_ns();
+        if (fb_request(index, 0) < 0 ||
+            fb_wait_reply('S', buffer, sizeof(buffer), 2000) <= 0) {
+            error("No reply from fbserver.");
+            free(latencies);
+            return -1;
+        }
+
+        if (frames == maxframes) {
+            maxframes *= 2;
+            latencies = realloc(latencies, maxframes*sizeof(*latencies));
+        }
+        latencies[frames++] = fb_now_ns() - t0;
+
+        struct screen_reply* reply = (struct screen_reply*)buffer;
+        if (reply->shmfailed)
+            failed++;
+        for (i = 0; i < reply->nrects; i++)
+            bytes += (uint64_t)reply->rects[i].width*reply->rects[i].height*4;
+        index = (index + 1) % NBUFFERS;
+    }
+    double elapsed = (fb_now_ns() - start) / 1e9;
+
+    qsort(latencies, frames, sizeof(*latencies), compare_u64);
+    printf("%-8s %6d frames, %7.1f fps, %9.0f bytes/frame, "
+           "latency p50 %6.2f ms, p99 %6.2f ms",
+           p->name, frames, frames / elapsed, (double)bytes / frames,
+           latencies[frames/2] / 1e6, latencies[frames*99/100] / 1e6);
+    if (failed)
+        printf(" (%d shm failures)", failed);
+    printf("\n");
+    print_stats(0);
+
+    free(latencies);
+    return 0;
+}
+
+/* Returns the full path of program in $PATH, or NULL */
+static char* find_in_path(const char* program) {
+    static char path[4096];
+    char* env = getenv("PATH");
+    char* dirs = strdup(env ? env : "/usr/bin:/bin");
+    char* dir;
+
+    for (dir = strtok(dirs, ":"); dir; dir = strtok(NULL, ":")) {
+        snprintf(path, sizeof(path), "%s/%s", dir, program);
+        if (access(path, X_OK) == 0) {
+            free(dirs);
+            return path;
+        }
+    }
+    free(dirs);
+    return NULL;
+}
+
+/* Runs argv in the background, discarding its output unless verbose */
+static pid_t spawn(char* const argv[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (verbose < 1) {
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Opens the display, waiting for the X server to start */
+static Display* open_display(const char* name) {
+    int i;
+    for (i = 0; i < 100; i++) {
+        Display* d = XOpenDisplay(name);
+        if (d)
+            return d;
+        usleep(50000);
+    }
+    return NULL;
+}
+
+/* Creates the window patterns are drawn in, covering the screen */
+static void create_window() {
+    XEvent ev;
+    win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0,
+                              width, height, 0, 0, 0xffffff);
+    XSelectInput(dpy, win, ExposureMask);
+    XMapWindow(dpy, win);
+    XWindowEvent(dpy, win, ExposureMask, &ev);
+    gc = XCreateGC(dpy, win, 0, NULL);
+    /* Do not report areas that XCopyArea cannot copy */
+    XSetGraphicsExposures(dpy, gc, False);
+}
+
+static void usage(char* argv0) {
+    fprintf(stderr, "%s [-v 0-3] [-t seconds] [-d display] "
+                    "[-g WIDTHxHEIGHT] [-x croutonfbserver] [pattern...]\n",
+            argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    char* fbserver = "./croutonfbserver";
+    char buffer[BUFFERSIZE];
+    double seconds = 2;
+    int display = 42;
+    int c, i, ret = 0;
+
+    while ((c = getopt(argc, argv, "v:t:d:g:x:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = atoi(optarg);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'd':
+            display = atoi(optarg);
+            break;
+        case 'g':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2)
+                usage(argv[0]);
+            break;
+        case 'x':
+            fbserver = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    char* xvfb = find_in_path("Xvfb");
+    if (!xvfb) {
+        printf("Xvfb not found: skipping fbserver benchmark.\n");
+        return 0;
+    }
+    if (access(fbserver, X_OK) < 0) {
+        printf("%s not found: skipping fbserver benchmark.\n", fbserver);
+        return 0;
+    }
+
+    char displayname[16], screen[32], socketpath[64], verbosity[8];
+    snprintf(displayname, sizeof(displayname), ":%d", display);
+    snprintf(screen, sizeof(screen), "%dx%dx24", width, height);
+    snprintf(socketpath, sizeof(socketpath), "/tmp/fbbench-%d.socket",
+             getpid());
+    snprintf(verbosity, sizeof(verbosity), "%d", verbose);
+
+    char* xargv[] = { xvfb, displayname, "-screen", "0", screen,
+                      "-nolisten", "tcp", "-noreset", NULL };
+    pid_t xpid = spawn(xargv);
+    pid_t fbpid = -1;
+
+    dpy = open_display(displayname);
+    if (!dpy) {
+        error("Cannot start Xvfb on %s.", displayname);
+        ret = 1;
+        goto out;
+    }
+    create_window();
+
+    if (fb_findnacl_listen(socketpath) < 0) {
+        ret = 1;
+        goto out;
+    }
+    char* fbargv[] = { fbserver, "-v", verbosity, "-s", socketpath,
+                       displayname, NULL };
+    fbpid = spawn(fbargv);
+
+    /* Wait for fbserver to listen */
+    for (i = 0; i < 100 && fb_connect(PORT_BASE + display) < 0; i++) {
+        if (fb_ws >= 0) {
+            error("Handshake failed.");
+            ret = 1;
+            goto out;
+        }
+        usleep(50000);
+    }
+    if (fb_ws < 0) {
+        error("Cannot connect to fbserver.");
+        ret = 1;
+        goto out;
+    }
+
+    for (i = 0; i < NBUFFERS; i++) {
+        if (fb_buffer_alloc(i, width, height) < 0 || fb_register(i) < 0) {
+            ret = 1;
+            goto out;
+        }
+    }
+    /* First frame: full copy */
+    if (fb_request(0, 1) < 0 ||
+        fb_wait_reply('S', buffer, sizeof(buffer), 5000) <= 0) {
+        error("No reply to the first frame request.");
+        ret = 1;
+        goto out;
+    }
+
+    printf("fbserver %dx%d, %.1f s per pattern\n", width, height, seconds);
+    for (i = 0; i < sizeof(patterns)/sizeof(*patterns); i++) {
+        int j, run = optind == argc;
+        for (j = optind; j < argc; j++)
+            run |= !strcmp(argv[j], patterns[i].name);
+        if (run && run_pattern(&patterns[i], seconds) < 0) {
+            ret = 1;
+            break;
+        }
+    }
+    log(1, "%lu lookups answered.", fb_lookups);
+
+out:
+    fb_disconnect();
+    if (fbpid > 0) {
+        kill(fbpid, SIGTERM);
+        waitpid(fbpid, NULL, 0);
+    }
+    if (dpy)
+        XCloseDisplay(dpy);
+    kill(xpid, SIGTERM);
+    waitpid(xpid, NULL, 0);
+    unlink(socketpath);
+    return ret;
+}
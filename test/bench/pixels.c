@@ -0,0 +1,513 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Checks the pixel helpers in src/fbserver-pixels.h, and measures how long
+ * they take.
+ *
+ * Usage: pixels [iterations]
+ * Exits with a non-zero status if any check fails.
+ */
+
+#include "../../src/fbserver-pixels.h"
+#include "qoi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int failures = 0;
+
+/* Returns CLOCK_MONOTONIC time, in seconds. */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Prints the result of a check: name is followed by the details of the
+ * first failing case, if any. */
+static void check(const char* name, const char* failed) {
+    if (failed[0]) {
+        printf("FAIL %s: %s\n", name, failed);
+        failures++;
+    } else {
+        printf("ok   %s\n", name);
+    }
+}
+
+/* Deterministic pseudo-random numbers (xorshift32) */
+static uint32_t rnd_state = 2463534242U;
+static uint32_t rnd() {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+enum { PATTERN_MIXED, PATTERN_SOLID, PATTERN_ROWS, PATTERNS };
+static const char* pattern_names[] = { "mixed", "solid", "rows" };
+
+/* Fills width x height pixels, rows stride pixels apart. The padding and the
+ * unused top byte of each pixel get garbage, which must be ignored.
+ *  - mixed: runs of any length (some across rows), small and larger color
+ *    steps, and colors seen before, so that every QOI chunk is used
+ *  - solid: a single color, so that the whole area is runs
+ *  - rows: one color per row, so that runs end at every row edge */
+static void fill_pattern(uint32_t* img, int stride, int width, int height,
+                         int pattern) {
+    static const uint32_t palette[] = {
+        0x000000, 0xffffff, 0x3465a4, 0xcc0000, 0x4e9a06, 0xc4a000,
+    };
+    uint32_t px = 0;
+    int run = 0;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < stride; x++) {
+            uint32_t garbage = rnd() << 24;
+            if (x >= width) {
+                img[y*stride + x] = rnd();
+                continue;
+            }
+            if (pattern == PATTERN_SOLID) {
+                px = 0x3465a4;
+            } else if (pattern == PATTERN_ROWS) {
+                px = palette[y % 6];
+            } else if (run > 0) {
+                run--;
+            } else {
+                uint32_t r = rnd();
+                switch (r % 5) {
+                case 0:  /* Run, up to a few rows long */
+                    run = (r >> 8) % 200;
+                    break;
+                case 1:  /* Small step */
+                    px += ((r >> 8) & 0x010101) - ((r >> 16) & 0x010101);
+                    break;
+                case 2:  /* Larger step, mostly on green */
+                    px += ((r >> 8) & 0x0f1f0f);
+                    break;
+                case 3:  /* Color seen before */
+                    px = palette[(r >> 8) % 6];
+                    break;
+                default:
+                    px = r >> 8;
+                }
+                px &= 0xffffff;
+            }
+            img[y*stride + x] = garbage | px;
+        }
+    }
+}
+
+/* Encodes width x height pixels in bands of rows, as stream_region does, and
+ * decodes each band back. Returns 0 if the output matches. */
+static int qoi_roundtrip(const uint32_t* img, int stride, int width,
+                         int height, int rows, int runs_only,
+                         uint8_t* data, uint32_t* out) {
+    int x, y;
+
+    for (y = 0; y < height; y += rows) {
+        int n = height - y < rows ? height - y : rows;
+        int length = qoi_encode(data, (const char*)(img + y*stride), width, n,
+                                stride*4, runs_only);
+        if (length > width*n*4)
+            return -1;
+        if (fb_qoi_decode(out + y*width, width, width, n, data, length) < 0)
+            return -1;
+    }
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            if (out[y*width + x] != (img[y*stride + x] & 0xffffff))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void test_qoi() {
+    /* Odd widths, and widths around the longest run (62) */
+    static const int widths[] = {
+        1, 2, 3, 7, 31, 61, 62, 63, 64, 65, 127, 333
+    };
+    /* Band heights: 1 row, bands that do not divide the height, one band */
+    static const int bands[] = { 1, 5, 16, 37 };
+    const int height = 37;
+    const int maxwidth = 333 + 3;
+    uint32_t* img = malloc(maxwidth*height*sizeof(*img));
+    uint32_t* out = malloc(maxwidth*height*sizeof(*out));
+    uint8_t* data = malloc(maxwidth*height*4);
+    char failed[128] = "";
+    int w, b, pattern, runs_only;
+
+    for (runs_only = 0; runs_only <= 1; runs_only++) {
+        for (pattern = 0; pattern < PATTERNS; pattern++) {
+            for (w = 0; w < sizeof(widths)/sizeof(*widths); w++) {
+                int width = widths[w];
+                /* Padded rows */
+                int stride = width + 3;
+                fill_pattern(img, stride, width, height, pattern);
+                for (b = 0; b < sizeof(bands)/sizeof(*bands); b++) {
+                    if (!failed[0] &&
+                            qoi_roundtrip(img, stride, width, height,
+                                          bands[b], runs_only, data, out)) {
+                        snprintf(failed, sizeof(failed),
+                                 "%s, width %d, bands of %d rows",
+                                 pattern_names[pattern], width, bands[b]);
+                    }
+                }
+            }
+        }
+        check(runs_only ? "qoi runs only" : "qoi", failed);
+        failed[0] = '\0';
+    }
+
+    /* A solid area only takes one byte per 62 pixels */
+    fill_pattern(img, 62, 62, height, PATTERN_SOLID);
+    int length = qoi_encode(data, (const char*)img, 62, height, 62*4, 0);
+    if (length != 4 + height)
+        snprintf(failed, sizeof(failed), "%d bytes", length);
+    check("qoi solid size", failed);
+
+    free(img);
+    free(out);
+    free(data);
+}
+
+/* Fills n bytes with pseudo-random data */
+static void fill_random(void* buffer, size_t n) {
+    uint8_t* p = buffer;
+    while (n-- > 0)
+        *p++ = rnd();
+}
+
+/* The conversion helpers process blocks of pixels with SIMD, and the rest
+ * with scalar code: n = 1 only takes the scalar path. For any length and
+ * alignment, converting n pixels at once must give the same output as
+ * converting them one by one, and must not write past the last pixel. */
+#define CONV_MAX 67  /* Odd: a few SIMD blocks, plus a tail */
+#define CONV_GUARD 0xdeadbeef
+
+static void test_load_pixels() {
+    static const struct pixel_format rgb565 = {
+        PIXELS_RGB565, 16, 0xf800, 0x07e0, 0x001f
+    };
+    static const struct pixel_format rgb555 = {
+        PIXELS_OTHER, 16, 0x7c00, 0x03e0, 0x001f
+    };
+    static const struct pixel_format bgrx = {
+        PIXELS_BGRX, 32, 0xff0000, 0xff00, 0xff
+    };
+    /* Known values: high bits are replicated in the low bits */
+    static const uint16_t in565[] = { 0xffff, 0xf800, 0x07e0, 0x001f, 0x0841 };
+    static const uint32_t out565[] = {
+        0xffffff, 0xff0000, 0x00ff00, 0x0000ff, 0x080808
+    };
+    static const uint16_t in555[] = { 0x7fff, 0x4210 };
+    static const uint32_t out555[] = { 0xffffff, 0x848484 };
+    char src[2*CONV_MAX + 16];
+    uint32_t dst[CONV_MAX + 4 + 1], one;
+    char failed[128] = "";
+    int off, doff, n, i;
+
+    fill_random(src, sizeof(src));
+    for (off = 0; off < 16; off++) {
+        for (doff = 0; doff < 4; doff++) {
+            for (n = 0; n <= CONV_MAX && !failed[0]; n++) {
+                dst[doff + n] = CONV_GUARD;
+                const uint32_t* px = load_pixels(dst + doff, src + off, n,
+                                                 &rgb565);
+                for (i = 0; i < n; i++) {
+                    load_pixels(&one, src + off + 2*i, 1, &rgb565);
+                    if (px[i] != one)
+                        break;
+                }
+                if (i < n || dst[doff + n] != CONV_GUARD) {
+                    snprintf(failed, sizeof(failed),
+                             "offset %d, dst offset %d, %d pixels",
+                             off, doff, n);
+                }
+            }
+        }
+    }
+    for (i = 0; i < sizeof(in565)/sizeof(*in565) && !failed[0]; i++) {
+        load_pixels(&one, (const char*)&in565[i], 1, &rgb565);
+        if (one != out565[i])
+            snprintf(failed, sizeof(failed), "%04x: %06x", in565[i], one);
+    }
+    check("load_pixels rgb565", failed);
+    failed[0] = '\0';
+
+    for (i = 0; i < sizeof(in555)/sizeof(*in555) && !failed[0]; i++) {
+        load_pixels(&one, (const char*)&in555[i], 1, &rgb555);
+        if (one != out555[i])
+            snprintf(failed, sizeof(failed), "%04x: %06x", in555[i], one);
+    }
+    if (load_pixels(dst, src, CONV_MAX, &bgrx) != (const uint32_t*)src)
+        snprintf(failed, sizeof(failed), "bgrx is not loaded in place");
+    check("load_pixels other", failed);
+}
+
+static void test_downscale_pixels() {
+    uint32_t a[2*CONV_MAX + 4], b[2*CONV_MAX + 4];
+    uint32_t dst[CONV_MAX + 4 + 1], one;
+    char failed[128] = "";
+    int off, doff, n, i;
+
+    fill_random(a, sizeof(a));
+    fill_random(b, sizeof(b));
+    for (off = 0; off < 4; off++) {
+        for (doff = 0; doff < 4; doff++) {
+            for (n = 0; n <= CONV_MAX && !failed[0]; n++) {
+                dst[doff + n] = CONV_GUARD;
+                downscale_pixels(dst + doff, a + off, b + off, n);
+                for (i = 0; i < n; i++) {
+                    downscale_pixels(&one, a + off + 2*i, b + off + 2*i, 1);
+                    if (dst[doff + i] != one)
+                        break;
+                }
+                if (i < n || dst[doff + n] != CONV_GUARD) {
+                    snprintf(failed, sizeof(failed),
+                             "offset %d, dst offset %d, %d pixels",
+                             off, doff, n);
+                }
+            }
+        }
+    }
+
+    /* Rounded average of each channel */
+    const uint32_t ka[] = { 0x00ff0003, 0x00fe0000 };
+    const uint32_t kb[] = { 0x00ff0000, 0x00ff0000 };
+    downscale_pixels(&one, ka, kb, 1);
+    if (!failed[0] && one != 0x00ff0001)
+        snprintf(failed, sizeof(failed), "%08x", one);
+    check("downscale_pixels", failed);
+}
+
+static void test_store_pixels() {
+    uint32_t src[CONV_MAX + 4], one;
+    char dst[4*CONV_MAX + 16 + 4];
+    char failed[128] = "";
+    int off, doff, n, i;
+
+    fill_random(src, sizeof(src));
+    for (off = 0; off < 4; off++) {
+        for (doff = 0; doff < 16; doff++) {
+            for (n = 0; n <= CONV_MAX && !failed[0]; n++) {
+                memset(dst, 0x5a, sizeof(dst));
+                store_pixels(dst + doff, src + off, n, FORMAT_RGBA);
+                for (i = 0; i < n; i++) {
+                    store_pixels((char*)&one, src + off + i, 1, FORMAT_RGBA);
+                    if (memcmp(dst + doff + 4*i, &one, sizeof(one)))
+                        break;
+                }
+                if (i < n || dst[doff + 4*n] != 0x5a) {
+                    snprintf(failed, sizeof(failed),
+                             "offset %d, dst offset %d, %d pixels",
+                             off, doff, n);
+                }
+            }
+        }
+    }
+
+    /* R, G, B, 0xff in memory */
+    const uint32_t px = 0x55112233;
+    const uint8_t rgba[] = { 0x11, 0x22, 0x33, 0xff };
+    store_pixels((char*)&one, &px, 1, FORMAT_RGBA);
+    if (!failed[0] && memcmp(&one, rgba, sizeof(rgba)))
+        snprintf(failed, sizeof(failed), "%08x", one);
+    check("store_pixels rgba", failed);
+}
+
+static void test_narrow_pixels() {
+    unsigned long src[CONV_MAX + 4];
+    uint32_t dst[CONV_MAX + 4 + 1], one;
+    char failed[128] = "";
+    int off, doff, n, i;
+
+    fill_random(src, sizeof(src));
+    for (off = 0; off < 4; off++) {
+        for (doff = 0; doff < 4; doff++) {
+            for (n = 0; n <= CONV_MAX && !failed[0]; n++) {
+                dst[doff + n] = CONV_GUARD;
+                narrow_pixels(dst + doff, src + off, n);
+                for (i = 0; i < n; i++) {
+                    narrow_pixels(&one, src + off + i, 1);
+                    if (dst[doff + i] != one || one != (uint32_t)src[off + i])
+                        break;
+                }
+                if (i < n || dst[doff + n] != CONV_GUARD) {
+                    snprintf(failed, sizeof(failed),
+                             "offset %d, dst offset %d, %d pixels",
+                             off, doff, n);
+                }
+            }
+        }
+    }
+    check("narrow_pixels", failed);
+}
+
+/* Hash of tile (tx, ty) of a width x height image, as hash_rows gets it */
+static uint64_t hash_tile(const char* img, int stride, int bpp,
+                          int width, int height, int tx, int ty) {
+    int left = tx*TILE_SIZE, top = ty*TILE_SIZE;
+    int w = width - left < TILE_SIZE ? width - left : TILE_SIZE;
+    int h = height - top < TILE_SIZE ? height - top : TILE_SIZE;
+    return tile_hash(img + top*stride + left*bpp, w*bpp, h, stride);
+}
+
+/* Returns 1 if changing one bit of pixel (x, y) changes the hash of its
+ * tile, and changing the row padding does not. */
+static int tile_hash_changes(char* img, int stride, int bpp,
+                             int width, int height, int x, int y) {
+    int tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+    uint64_t before = hash_tile(img, stride, bpp, width, height, tx, ty);
+    char* px = img + y*stride + x*bpp;
+
+    *px ^= 0x01;
+    uint64_t after = hash_tile(img, stride, bpp, width, height, tx, ty);
+    *px ^= 0x01;
+
+    img[y*stride + width*bpp] ^= 0x01;
+    uint64_t padded = hash_tile(img, stride, bpp, width, height, tx, ty);
+    img[y*stride + width*bpp] ^= 0x01;
+
+    return after != before && padded == before;
+}
+
+static void test_tile_hash() {
+    /* Partial tiles on the right and bottom edges. With 37 pixels, rows of
+     * the last tile do not fill the 16-byte blocks of the hash. */
+    static const struct {
+        int width, height, bpp;
+    } sizes[] = {
+        { 1000, 600, 4 },  /* Last tile: 40x24 */
+        { 997, 601, 4 },  /* 37x25 */
+        { 997, 601, 2 },  /* 37x25, 16-bit */
+        { 64, 64, 4 },  /* A single full tile */
+    };
+    char failed[128] = "";
+    int i, x, y;
+
+    for (i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        int width = sizes[i].width, height = sizes[i].height;
+        int bpp = sizes[i].bpp;
+        int stride = width*bpp + 12;
+        char* img = malloc(stride*height);
+        int left = (width - 1) / TILE_SIZE * TILE_SIZE;
+        int top = (height - 1) / TILE_SIZE * TILE_SIZE;
+
+        fill_random(img, stride*height);
+        /* Every pixel of the last tile */
+        for (y = top; y < height && !failed[0]; y++) {
+            for (x = left; x < width && !failed[0]; x++) {
+                if (!tile_hash_changes(img, stride, bpp, width, height, x, y))
+                    snprintf(failed, sizeof(failed),
+                             "%dx%d, %d bpp: last tile, pixel %d,%d",
+                             width, height, 8*bpp, x, y);
+            }
+        }
+        /* Every other pixel of the last tile row */
+        for (y = top; y < height && !failed[0]; y++) {
+            for (x = 0; x < left && !failed[0]; x++) {
+                if (!tile_hash_changes(img, stride, bpp, width, height, x, y))
+                    snprintf(failed, sizeof(failed),
+                             "%dx%d, %d bpp: last tile row, pixel %d,%d",
+                             width, height, 8*bpp, x, y);
+            }
+        }
+        free(img);
+    }
+    check("tile_hash edges", failed);
+}
+
+static void bench_qoi(int iterations) {
+    const int width = 1280, height = 800;
+    uint32_t* img = malloc(width*height*sizeof(*img));
+    uint8_t* data = malloc(width*height*4);
+    int runs_only, length = 0;
+    int i;
+
+    fill_pattern(img, width, width, height, PATTERN_MIXED);
+    for (runs_only = 0; runs_only <= 1; runs_only++) {
+        double start = now();
+        for (i = 0; i < iterations; i++) {
+            length = qoi_encode(data, (const char*)img, width, height,
+                                width*4, runs_only);
+        }
+        double t = now() - start;
+        printf("%-13s %dx%d: %8.1f us/frame, %6.2f GB/s, ratio %.3f\n",
+               runs_only ? "qoi runs only" : "qoi", width, height,
+               t / iterations * 1e6,
+               (double)width*height*4 * iterations / t / 1e9,
+               (double)length / (width*height*4));
+    }
+
+    free(img);
+    free(data);
+}
+
+static void bench_conversion(int iterations) {
+    static const struct pixel_format rgb565 = {
+        PIXELS_RGB565, 16, 0xf800, 0x07e0, 0x001f
+    };
+    const int width = 1280, height = 800;
+    char* src = malloc(width*height*2);
+    uint32_t* row0 = malloc(width*sizeof(*row0));
+    uint32_t* row1 = malloc(width*sizeof(*row1));
+    char* dst = malloc(width*height*4);
+    int i, y;
+
+    fill_random(src, width*height*2);
+    /* Full frame, as convert_rows does: 16-bit to RGBA, then 2:1 */
+    double start = now();
+    for (i = 0; i < iterations; i++) {
+        for (y = 0; y < height; y++) {
+            const uint32_t* px = load_pixels(row0, src + y*width*2, width,
+                                             &rgb565);
+            store_pixels(dst + y*width*4, px, width, FORMAT_RGBA);
+        }
+    }
+    double t = now() - start;
+    printf("rgb565 to rgba %dx%d: %8.1f us/frame\n",
+           width, height, t / iterations * 1e6);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (y = 0; y < height; y += 2) {
+            const uint32_t* a = load_pixels(row0, src + y*width*2, width,
+                                            &rgb565);
+            const uint32_t* b = load_pixels(row1, src + (y+1)*width*2, width,
+                                            &rgb565);
+            downscale_pixels(row0, a, b, width/2);
+            store_pixels(dst + y/2*width*2, row0, width/2, FORMAT_RGBA);
+        }
+    }
+    t = now() - start;
+    printf("rgb565 to rgba 2:1 %dx%d: %8.1f us/frame\n",
+           width, height, t / iterations * 1e6);
+
+    free(src);
+    free(row0);
+    free(row1);
+    free(dst);
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+
+    test_qoi();
+    test_load_pixels();
+    test_downscale_pixels();
+    test_store_pixels();
+    test_narrow_pixels();
+    test_tile_hash();
+
+    if (iterations > 0) {
+        bench_qoi(iterations);
+        bench_conversion(iterations);
+    }
+
+    return failures ? 1 : 0;
+}
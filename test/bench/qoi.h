@@ -0,0 +1,74 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Decoder for CODEC_QOI rect_data (see fbserver-proto.h), shared by the test
+ * client and the pixel checks.
+ */
+
+#ifndef FB_QOI_H_
+#define FB_QOI_H_
+
+#include "../../src/fbserver-proto.h"
+
+/* Decodes length bytes of CODEC_QOI data into width x height pixels of dst,
+ * rows stride pixels apart. Returns 0 if the data covers the area exactly. */
+static int fb_qoi_decode(uint32_t* dst, int stride, int width, int height,
+                         const uint8_t* data, int length) {
+    uint32_t index[64] = { 0 };
+    uint32_t px = 0;
+    int run = 0;
+    int pos = 0;
+    int x, y;
+
+    for (y = 0; y < height; y++, dst += stride) {
+        for (x = 0; x < width; x++) {
+            if (run > 0) {
+                run--;
+                dst[x] = px;
+                continue;
+            }
+            if (pos >= length)
+                return -1;
+
+            int r = px >> 16, g = (px >> 8) & 0xff, b = px & 0xff;
+            uint8_t op = data[pos++];
+            if (op == 0xfe) {
+                if (pos + 3 > length)
+                    return -1;
+                r = data[pos];
+                g = data[pos+1];
+                b = data[pos+2];
+                pos += 3;
+            } else if ((op & 0xc0) == 0x00) {
+                px = index[op];
+                dst[x] = px;
+                continue;
+            } else if ((op & 0xc0) == 0x40) {
+                r += ((op >> 4) & 3) - 2;
+                g += ((op >> 2) & 3) - 2;
+                b += (op & 3) - 2;
+            } else if ((op & 0xc0) == 0x80) {
+                if (pos >= length)
+                    return -1;
+                int dg = (op & 0x3f) - 32;
+                r += dg - 8 + (data[pos] >> 4);
+                g += dg;
+                b += dg - 8 + (data[pos] & 0x0f);
+                pos++;
+            } else if (op == 0xff) {
+                return -1;  /* QOI_OP_RGBA is not used */
+            } else {
+                run = op & 0x3f;
+            }
+
+            px = (r & 0xff) << 16 | (g & 0xff) << 8 | (b & 0xff);
+            index[QOI_HASH(r & 0xff, g & 0xff, b & 0xff)] = px;
+            dst[x] = px;
+        }
+    }
+
+    return pos == length && run == 0 ? 0 : -1;
+}
+
+#endif /* FB_QOI_H_ */
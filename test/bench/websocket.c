@@ -0,0 +1,179 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Checks the WebSocket helpers in src/websocket.h against known vectors, and
+ * measures how long they take.
+ *
+ * Usage: websocket [iterations]
+ * Exits with a non-zero status if any vector does not match.
+ */
+
+#include "../../src/websocket.h"
+#include <time.h>
+
+static int failures = 0;
+
+/* Returns CLOCK_MONOTONIC time, in seconds. */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(const char* name, const char* got, const char* expected) {
+    if (strcmp(got, expected)) {
+        printf("FAIL %s: '%s' != '%s'\n", name, got, expected);
+        failures++;
+    } else {
+        printf("ok   %s\n", name);
+    }
+}
+
+/* SHA-1 of len bytes of data, in hexadecimal */
+static void sha1_hex(const char* data, size_t len, char* out) {
+    char hash[SHA1_LEN];
+    int i;
+    sha1(data, len, hash);
+    for (i = 0; i < SHA1_LEN; i++)
+        sprintf(out + 2*i, "%02x", (uint8_t)hash[i]);
+}
+
+static void test_sha1() {
+    /* FIPS 180-2, appendix A, plus boundary lengths */
+    static const struct {
+        const char* data;
+        const char* hash;
+    } vectors[] = {
+        { "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+        { "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+        { "The quick brown fox jumps over the lazy dog",
+          "2fd4e1c67a2d28fced849ee1bb76e7391b93eb12" },
+    };
+    char out[2*SHA1_LEN + 1];
+    int i;
+
+    for (i = 0; i < sizeof(vectors)/sizeof(*vectors); i++) {
+        sha1_hex(vectors[i].data, strlen(vectors[i].data), out);
+        check("sha1", out, vectors[i].hash);
+    }
+
+    /* One million 'a' */
+    size_t len = 1000000;
+    char* data = malloc(len);
+    memset(data, 'a', len);
+    sha1_hex(data, len, out);
+    check("sha1 1M", out, "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+    free(data);
+}
+
+static void test_base64() {
+    /* RFC 4648, section 10 */
+    static const struct {
+        const char* data;
+        const char* b64;
+    } vectors[] = {
+        { "", "" },
+        { "f", "Zg==" },
+        { "fo", "Zm8=" },
+        { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" },
+        { "fooba", "Zm9vYmE=" },
+        { "foobar", "Zm9vYmFy" },
+    };
+    char out[16];
+    int i;
+
+    for (i = 0; i < sizeof(vectors)/sizeof(*vectors); i++) {
+        base64_encode(vectors[i].data, strlen(vectors[i].data), out);
+        check("base64", out, vectors[i].b64);
+    }
+}
+
+static void test_accept_key() {
+    /* RFC 6455, section 1.3 */
+    char out[SHA1_BASE64_LEN + 1];
+    websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ==", out);
+    check("accept key", out, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+static void test_unmask() {
+    const uint32_t maskkey = 0x37fa213d;
+    const uint8_t* key = (const uint8_t*)&maskkey;
+    char buffer[256 + 64], expected[256 + 64];
+    int offset, size, i;
+    int ok = 1;
+
+    /* All alignments, sizes around the vector widths */
+    for (offset = 0; offset < 64; offset++) {
+        for (size = 0; size < 256; size++) {
+            for (i = 0; i < size; i++) {
+                buffer[offset+i] = i * 7 + offset;
+                expected[offset+i] = buffer[offset+i] ^ key[i % 4];
+            }
+            websocket_unmask(buffer + offset, size, maskkey);
+            if (memcmp(buffer + offset, expected + offset, size)) {
+                printf("FAIL unmask: offset %d, size %d\n", offset, size);
+                ok = 0;
+            }
+        }
+    }
+
+    if (ok)
+        printf("ok   unmask\n");
+    else
+        failures++;
+}
+
+static void bench_unmask(int iterations) {
+    char* buffer = malloc(MAXFRAMESIZE + 1);
+    int size;
+
+    memset(buffer, 0x5a, MAXFRAMESIZE + 1);
+    for (size = 16; size <= MAXFRAMESIZE; size *= 4) {
+        /* Same amount of data for each size */
+        long n = (long)iterations * 1024 / size + 1;
+        long i;
+        double start = now();
+        for (i = 0; i < n; i++)
+            websocket_unmask(buffer + (i & 1), size, 0x37fa213d);
+        double t = now() - start;
+        printf("unmask %8d bytes: %8.1f ns/frame, %6.2f GB/s\n",
+               size, t / n * 1e9, (double)size * n / t / 1e9);
+    }
+
+    free(buffer);
+}
+
+static void bench_accept_key(int iterations) {
+    char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+    char out[SHA1_BASE64_LEN + 1];
+    int i;
+
+    double start = now();
+    for (i = 0; i < iterations; i++) {
+        key[i % SECKEY_LEN] ^= 1;
+        websocket_accept_key(key, out);
+    }
+    double t = now() - start;
+    printf("accept key: %d iterations, %.3f us/handshake\n",
+           iterations, t / iterations * 1e6);
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+    test_sha1();
+    test_base64();
+    test_accept_key();
+    test_unmask();
+
+    if (iterations > 0) {
+        bench_accept_key(iterations);
+        bench_unmask(iterations);
+    }
+
+    return failures ? 1 : 0;
+}
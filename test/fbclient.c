@@ -0,0 +1,554 @@
+/* Copyright (c) 2016 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Headless stand-in for the kiwi NaCl module: connects to a running
+ * croutonfbserver, lets it fill memfd buffers through a stand-in findnacld
+ * socket, requests frames at a given rate, and replays input traces. Meant for
+ * load and soak tests without a Chromebook.
+ *
+ * croutonfbserver must be started with -s pointing to the same socket:
+ *   croutonfbserver -s /tmp/fbclient.socket :1 &
+ *   fbclient -d 1 -f 30 -r trace.txt -l -t 0
+ *
+ * Input traces are text files, one event per line, replayed in 'E' packets:
+ *   <ms since start> K <keycode> <1: down, 0: up>
+ *   <ms since start> C <button> <1: down, 0: up>
+ *   <ms since start> M <x> <y>
+ * Lines starting with # are ignored. Coordinates are in frame pixels (see -x).
+ *
+ * With -n, frames are requested without shm: fbserver streams the changed
+ * areas, which are decoded into a local frame buffer.
+ *
+ * Statistics are printed every interval; the exit status is non-zero if
+ * fbserver disconnects, stops answering, or fails to fill a buffer.
+ */
+
+#include "bench/fbclient.h"
+#include "bench/qoi.h"
+
+/* Buffers in the ring (as in kiwi) */
+#define NBUFFERS 3
+/* Largest packet expected from fbserver (streamed pixel data) */
+#define MAX_PACKET (4 << 20)
+/* A frame that takes longer than this is an error (fbserver answers held
+ * requests after 500 ms even if nothing changed) */
+#define REPLY_TIMEOUT_MS 5000
+
+/* Options */
+static int width = 1280;
+static int height = 1024;
+static int fps = 30;  /* 0: as fast as possible */
+static int subscribe = 0;
+static int stream = 0;
+static int resize = 0;
+static struct output output = {
+    .type = 'O', .format = FORMAT_BGRX, .scale = 1
+};
+static int loop = 0;
+static double duration = 10;  /* 0: forever */
+static double interval = 10;
+
+/* Streaming: frame buffer, updated by rect_data packets */
+static uint32_t* framebuffer;
+
+/* Ring state */
+static int flying[NBUFFERS];  /* Request in flight for the buffer */
+static uint64_t requested[NBUFFERS];  /* When the request was sent */
+
+/* Input trace */
+static struct input_event* trace;
+static uint32_t ntrace;
+static uint32_t trace_pos;
+static uint64_t trace_start;
+
+/* Total number of buffers fbserver failed to fill */
+static unsigned long shmfailures;
+
+/* Statistics, since the last report */
+static struct {
+    unsigned long frames;
+    unsigned long updated;
+    unsigned long shmfailed;
+    unsigned long cursors;
+    unsigned long events;
+    uint64_t bytes;
+    uint64_t wire;  /* Bytes of streamed pixel data */
+    uint64_t* latencies;
+    int nlatencies;
+    int maxlatencies;
+} st;
+
+/* Loads the input trace in file. Returns 0 on success. */
+static int load_trace(const char* file) {
+    FILE* f = fopen(file, "r");
+    char line[256];
+    int n = 0, maxn = 256;
+
+    if (!f) {
+        syserror("Cannot open %s.", file);
+        return -1;
+    }
+    trace = malloc(maxn*sizeof(*trace));
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int time, a, b;
+        char type;
+        n++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%u %c %u %u", &time, &type, &a, &b) != 4 ||
+            (type != 'K' && type != 'C' && type != 'M')) {
+            error("%s:%d: invalid event.", file, n);
+            fclose(f);
+            return -1;
+        }
+        if (ntrace == maxn) {
+            maxn *= 2;
+            trace = realloc(trace, maxn*sizeof(*trace));
+        }
+        struct input_event* ev = &trace[ntrace++];
+        memset(ev, 0, sizeof(*ev));
+        ev->type = type;
+        ev->time = time;
+        if (type == 'M') {
+            ev->x = a;
+            ev->y = b;
+        } else {
+            ev->code = a;
+            ev->down = b;
+        }
+    }
+    fclose(f);
+    log(1, "Loaded %u events from %s.", ntrace, file);
+    return 0;
+}
+
+/* Sends the trace events that are due, in a single 'E' packet (several if
+ * there are more than MAX_INPUT_EVENTS). Returns the time of the next
+ * event, 0 if the trace is over. */
+static uint64_t replay_trace(uint64_t now) {
+    char buffer[sizeof(struct input) +
+                MAX_INPUT_EVENTS*sizeof(struct input_event)];
+    struct input* in = (struct input*)buffer;
+
+    while (trace_pos < ntrace) {
+        uint64_t due = trace_start + trace[trace_pos].time*1000000ULL;
+        if (due > now)
+            return due;
+
+        in->type = 'E';
+        in->count = 0;
+        while (trace_pos < ntrace && in->count < MAX_INPUT_EVENTS &&
+               trace_start + trace[trace_pos].time*1000000ULL <= now) {
+            in->events[in->count] = trace[trace_pos++];
+            in->events[in->count].time = now / 1000000;
+            in->count++;
+        }
+        st.events += in->count;
+        fb_send(in, sizeof(*in) + in->count*sizeof(struct input_event),
+                WS_OPCODE_BINARY);
+
+        if (trace_pos == ntrace && loop) {
+            /* Start over, right after the last event */
+            trace_start += trace[ntrace-1].time*1000000ULL + 1000000;
+            trace_pos = 0;
+        }
+    }
+    return 0;
+}
+
+/* Requests a frame without shm: changed areas are streamed in rect_data
+ * packets before the reply. index is only echoed back in the reply. */
+static int fb_request_stream(int index, int width, int height, int refresh) {
+    struct screen s = { 0 };
+    s.type = 'S';
+    s.refresh = refresh;
+    s.buffer = index;
+    s.width = width;
+    s.height = height;
+    return fb_send(&s, sizeof(s), WS_OPCODE_BINARY);
+}
+
+/* Sends a frame request for every free buffer (subscribed), or for the next
+ * one if no request is in flight. */
+static void request_frames(uint64_t now) {
+    int i;
+    for (i = 0; i < NBUFFERS; i++) {
+        if (flying[i])
+            continue;
+        if (!subscribe) {
+            int j;
+            for (j = 0; j < NBUFFERS && !flying[j]; j++);
+            if (j < NBUFFERS)
+                return;
+        }
+        if (stream)
+            fb_request_stream(i, width, height, 0);
+        else
+            fb_request(i, 0);
+        flying[i] = 1;
+        requested[i] = now;
+        if (!subscribe)
+            return;
+    }
+}
+
+/* Handles a reply to a frame request. Returns 0 on success. */
+static int handle_screen(const char* buffer, int length, uint64_t now) {
+    const struct screen_reply* reply = (const struct screen_reply*)buffer;
+    int i;
+
+    if (length < sizeof(*reply) ||
+        length != sizeof(*reply) + reply->nrects*sizeof(struct rect)) {
+        error("Invalid screen reply (%d bytes).", length);
+        return -1;
+    }
+    if (reply->buffer >= NBUFFERS || !flying[reply->buffer]) {
+        error("Reply for buffer %d, which was not requested.",
+              reply->buffer);
+        return -1;
+    }
+
+    flying[reply->buffer] = 0;
+    st.frames++;
+    if (reply->updated)
+        st.updated++;
+    if (reply->shmfailed) {
+        st.shmfailed++;
+        shmfailures++;
+    }
+    for (i = 0; i < reply->nrects; i++)
+        st.bytes += (uint64_t)reply->rects[i].width*reply->rects[i].height*4;
+
+    if (st.nlatencies == st.maxlatencies) {
+        st.maxlatencies = st.maxlatencies ? 2*st.maxlatencies : 1024;
+        st.latencies = realloc(st.latencies,
+                               st.maxlatencies*sizeof(*st.latencies));
+    }
+    st.latencies[st.nlatencies++] = now - requested[reply->buffer];
+
+    /* Fetch new cursors, as kiwi does (the cache is never used) */
+    if (reply->cursor_updated) {
+        struct cursor p = { .type = 'P' };
+        fb_send(&p, sizeof(p), WS_OPCODE_BINARY);
+    }
+    return 0;
+}
+
+/* Decodes streamed pixel data into framebuffer. Returns 0 on success. */
+static int handle_data(const char* buffer, int length) {
+    const struct rect_data* d = (const struct rect_data*)buffer;
+    const struct rect* r = &d->rect;
+    int size = length - sizeof(*d);
+    int y;
+
+    if (length < sizeof(*d) || r->x + r->width > width ||
+            r->y + r->height > height) {
+        error("Invalid rect_data packet.");
+        return -1;
+    }
+
+    uint32_t* dst = framebuffer + r->y*width + r->x;
+    if (d->codec == CODEC_RAW && size == r->width*r->height*4) {
+        for (y = 0; y < r->height; y++) {
+            memcpy(dst + y*width, d->data + y*r->width*4, r->width*4);
+        }
+    } else if (d->codec != CODEC_QOI ||
+               fb_qoi_decode(dst, width, r->width, r->height,
+                             d->data, size) < 0) {
+        error("Cannot decode %dx%d rectangle (codec %d, %d bytes).",
+              r->width, r->height, d->codec, size);
+        return -1;
+    }
+    st.wire += size;
+    return 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints statistics for the last period (seconds long), and resets them.
+ * Server timings follow, when the reply to the 'T' request arrives. */
+static void report(double elapsed, double seconds) {
+    uint64_t p50 = 0, p99 = 0;
+    if (st.nlatencies > 0) {
+        qsort(st.latencies, st.nlatencies, sizeof(*st.latencies),
+              compare_u64);
+        p50 = st.latencies[st.nlatencies/2];
+        p99 = st.latencies[st.nlatencies*99/100];
+    }
+    printf("%8.0fs: %6.1f fps (%lu updated), %8.0f KiB/s, "
+           "latency p50 %6.2f ms, p99 %6.2f ms, %lu events, %lu cursors, ",
+           elapsed, st.frames / seconds, st.updated,
+           st.bytes / 1024.0 / seconds, p50 / 1e6, p99 / 1e6,
+           st.events, st.cursors);
+    if (stream)
+        printf("%8.0f KiB/s streamed\n", st.wire / 1024.0 / seconds);
+    else
+        printf("%lu lookups, %lu shm failures\n", fb_lookups, st.shmfailed);
+    fflush(stdout);
+
+    uint64_t* latencies = st.latencies;
+    int maxlatencies = st.maxlatencies;
+    memset(&st, 0, sizeof(st));
+    st.latencies = latencies;
+    st.maxlatencies = maxlatencies;
+
+    struct stats t = { .type = 'T', .reset = 1 };
+    fb_send(&t, sizeof(t), WS_OPCODE_BINARY);
+}
+
+/* Prints the server timings from a stats reply */
+static void print_stats(const char* buffer, int length) {
+    static const char* names[STATS_STAGES] = {
+        "events", "find_shm", "capture", "convert", "copy", "reply",
+        "frame"
+    };
+    const struct stats_reply* r = (const struct stats_reply*)buffer;
+    int i, j;
+
+    if (length != sizeof(*r))
+        return;
+    printf("          server:");
+    for (i = 0; i < STATS_STAGES; i++) {
+        uint64_t count = 0;
+        for (j = 0; j < STATS_BUCKETS; j++)
+            count += r->counts[i][j];
+        if (count > 0)
+            printf(" %s %.1f us", names[i], (double)r->total_us[i] / count);
+    }
+    if (r->input_injected || r->input_coalesced)
+        printf(", input %u injected, %u coalesced",
+               r->input_injected, r->input_coalesced);
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Asks fbserver to change the resolution to width x height, as kiwi does on
+ * connection, and uses the size it replies with. Returns 0 on success. */
+static int change_resolution() {
+    char buffer[BUFFERSIZE];
+    struct resolution r = { .type = 'R', .width = width, .height = height };
+    if (fb_send(&r, sizeof(r), WS_OPCODE_BINARY) < 0 ||
+        fb_wait_reply('R', buffer, sizeof(buffer), REPLY_TIMEOUT_MS) !=
+            sizeof(r))
+        return -1;
+    memcpy(&r, buffer, sizeof(r));
+    width = r.width;
+    height = r.height;
+    log(1, "Resolution: %dx%d", width, height);
+    return 0;
+}
+
+static void usage(char* argv0) {
+    fprintf(stderr,
+            "%s [-v 0-3] [-d display] [-s socket] [-g WIDTHxHEIGHT] [-R]\n"
+            "    [-f fps] [-u] [-n] [-c bgrx|rgba] [-x 1|2] [-r trace [-l]]\n"
+            "    [-t seconds] [-i seconds]\n"
+            "  -d  display served by croutonfbserver (default: 0)\n"
+            "  -s  stand-in findnacld socket, as passed to croutonfbserver\n"
+            "      (default: /tmp/fbclient.socket)\n"
+            "  -g  screen size (default: 1280x1024)\n"
+            "  -R  ask fbserver to set the resolution first, as kiwi does\n"
+            "  -f  frame rate, 0 for as fast as possible (default: 30)\n"
+            "  -u  subscribe: fbserver pushes frames into free buffers\n"
+            "  -n  no shm: fbserver streams the changed areas\n"
+            "  -c  pixel format of frames (default: bgrx)\n"
+            "  -x  downscale frames (and scale input) by this factor\n"
+            "  -r  replay input trace, -l to loop over it\n"
+            "  -t  duration, 0 to run forever (default: 10)\n"
+            "  -i  statistics interval (default: 10)\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    char* socketpath = "/tmp/fbclient.socket";
+    char* tracefile = NULL;
+    static char buffer[MAX_PACKET];
+    int display = 0;
+    int c, i, ret = 0;
+
+    while ((c = getopt(argc, argv, "v:d:s:g:Rf:unc:x:r:lt:i:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = atoi(optarg);
+            break;
+        case 'd':
+            display = atoi(optarg);
+            break;
+        case 's':
+            socketpath = optarg;
+            break;
+        case 'g':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2)
+                usage(argv[0]);
+            break;
+        case 'R':
+            resize = 1;
+            break;
+        case 'f':
+            fps = atoi(optarg);
+            break;
+        case 'u':
+            subscribe = 1;
+            break;
+        case 'n':
+            stream = 1;
+            break;
+        case 'c':
+            if (!strcmp(optarg, "rgba"))
+                output.format = FORMAT_RGBA;
+            else if (strcmp(optarg, "bgrx"))
+                usage(argv[0]);
+            break;
+        case 'x':
+            output.scale = atoi(optarg);
+            break;
+        case 'r':
+            tracefile = optarg;
+            break;
+        case 'l':
+            loop = 1;
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || fps < 0 || fps > 255 || interval <= 0)
+        usage(argv[0]);
+
+    srand(getpid() ^ time(NULL));
+    if ((tracefile && load_trace(tracefile) < 0) ||
+        (!stream && fb_findnacl_listen(socketpath) < 0))
+        return 1;
+
+    if (fb_connect(PORT_BASE + display) < 0) {
+        error("Cannot connect to fbserver on display :%d.", display);
+        return 1;
+    }
+    if (resize && change_resolution() < 0) {
+        error("Cannot change resolution.");
+        return 1;
+    }
+    if (output.format != FORMAT_BGRX || output.scale != 1) {
+        /* Frames are smaller than the screen */
+        fb_send(&output, sizeof(output), WS_OPCODE_BINARY);
+        width /= output.scale;
+        height /= output.scale;
+    }
+    if (stream) {
+        framebuffer = calloc((size_t)width*height, sizeof(*framebuffer));
+    } else {
+        for (i = 0; i < NBUFFERS; i++) {
+            if (fb_buffer_alloc(i, width, height) < 0 || fb_register(i) < 0)
+                return 1;
+        }
+    }
+    if (subscribe) {
+        struct subscribe u = { .type = 'U', .fps = fps ? fps : 255 };
+        fb_send(&u, sizeof(u), WS_OPCODE_BINARY);
+    }
+
+    uint64_t start = fb_now_ns();
+    uint64_t end = duration > 0 ? start + duration*1e9 : 0;
+    uint64_t next_report = start + interval*1e9;
+    uint64_t last_report = start;
+    uint64_t next_frame = start;
+    uint64_t next_input = ntrace > 0 ? start : 0;
+    uint64_t frame_interval = fps > 0 && !subscribe ? 1000000000ULL/fps : 0;
+    trace_start = start;
+
+    while (1) {
+        uint64_t now = fb_now_ns();
+
+        if (end && now >= end)
+            break;
+        if (next_input && now >= next_input)
+            next_input = replay_trace(now);
+        if (now >= next_frame) {
+            request_frames(now);
+            next_frame = now + frame_interval;
+        }
+        if (now >= next_report) {
+            report((now - start) / 1e9, (now - last_report) / 1e9);
+            last_report = now;
+            next_report += interval*1e9;
+        }
+        for (i = 0; i < NBUFFERS; i++) {
+            if (flying[i] && now - requested[i] > REPLY_TIMEOUT_MS*1000000ULL) {
+                error("No reply for buffer %d after %d ms.",
+                      i, REPLY_TIMEOUT_MS);
+                ret = 1;
+                goto out;
+            }
+        }
+
+        /* Sleep until the next deadline, or a packet arrives */
+        uint64_t next = next_report;
+        if (end && end < next)
+            next = end;
+        if (next_input && next_input < next)
+            next = next_input;
+        if (next_frame > now && next_frame < next)
+            next = next_frame;
+        int n = fb_wait((next - now + 999999) / 1000000);
+        if (n < 0) {
+            ret = 1;
+            break;
+        }
+        if (n == 0)
+            continue;
+
+        int length = fb_recv(buffer, sizeof(buffer));
+        if (length < 0) {
+            ret = 1;
+            break;
+        }
+        if (length == 0)
+            continue;
+
+        now = fb_now_ns();
+        switch (buffer[0]) {
+        case 'S':
+            if (handle_screen(buffer, length, now) < 0) {
+                ret = 1;
+                goto out;
+            }
+            /* Hand the buffer back right away */
+            if (subscribe || frame_interval == 0)
+                next_frame = now;
+            break;
+        case 'D':
+            if (handle_data(buffer, length) < 0) {
+                ret = 1;
+                goto out;
+            }
+            break;
+        case 'P':
+        case 'H':
+            st.cursors++;
+            break;
+        case 'T':
+            print_stats(buffer, length);
+            break;
+        default:
+            log(2, "Ignoring packet '%c' (%d bytes).", buffer[0], length);
+        }
+    }
+
+    report((fb_now_ns() - start) / 1e9, (fb_now_ns() - last_report) / 1e9);
+
+out:
+    fb_disconnect();
+    if (!stream)
+        unlink(socketpath);
+    return ret || shmfailures > 0;
+}